@@ -5,27 +5,114 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <termios.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 4
+// bytes of a row between two of the marks that map byte offsets to
+// screen columns, see renderSlot.
+#define KILO_RENDER_MARK 128
 #define KILO_QUIT_TIMES 3
+#define KILO_STATUS_SECS 5
+// how long to wait for the rest of an escape sequence, and the shortest
+// time between two frames drawn for background events.
+#define KILO_ESC_WAIT 50
+#define KILO_FRAME_MS 16
+// rows held by one node of the row buffer, see "row buffer" below.
+#define KILO_BLOCK_ROWS 256
+// bytes of the mapped file scanned for newlines in one go, and how many
+// lines apart the line index keeps an offset.
+#define KILO_INDEX_CHUNK (1 << 20)
+#define KILO_INDEX_STRIDE 64
+#define KILO_INDEX_THREADS 8
+// address space kept free behind a followed file, so its mapping can grow
+// in place.
+#define KILO_FOLLOW_RESERVE ((size_t)1 << 40)
+// pieces a save hands to one writev() call, and the most bytes of the
+// file mapping one piece may cover.
+#define KILO_SAVE_IOV 1024
+#define KILO_SAVE_SPAN (1 << 30)
+// a save may rewrite just the changed part of the file in place when that
+// part kept its length, is at most this big and at most half the file.
+#define KILO_SAVE_REGION (16 << 20)
+// text of edited rows is kept in power-of-two chunks of KILO_SLAB_MIN to
+// KILO_SLAB_MAX bytes cut from slabs of KILO_SLAB_BYTES, see "row storage".
+#define KILO_SLAB_MIN 16
+#define KILO_SLAB_MAX 2048
+#define KILO_SLAB_CLASSES 8
+#define KILO_SLAB_BYTES (64 * 1024)
+// unchanged cells a screen update resends rather than moving the cursor.
+#define KILO_SPAN_GAP 6
+// blank cells from which erasing them (ECH) beats sending spaces.
+#define KILO_ERASE_MIN 12
+// rows the search thread scans between two looks at the shared state.
+#define KILO_SEARCH_BATCH 4096
+#define KILO_SEARCH_THREADS 8
+// limits on regex patterns: the largest {m,n} count, the size of the
+// compiled program, and the DFA states a search thread caches.
+#define KILO_RE_REPEAT 1000
+#define KILO_RE_INSTS 20000
+#define KILO_RE_STATES 1024
+#define KILO_RE_MUST 64
+// the most memory the undo log may use; the oldest steps are dropped to
+// stay below it.
+#define KILO_UNDO_MEM (64 << 20)
+// how long the journal writer lets changes gather before it writes and
+// syncs them in one go.
+#define KILO_JOURNAL_MS 200
+// how far above a row the highlighter looks for a row whose state it
+// knows; from further up it assumes the row starts outside any comment.
+#define KILO_HL_SYNC 1000
+
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
-#define DEBUG 0
+// The editor counts its allocations, see "perf" below.
+void *perfMalloc(size_t n);
+void *perfCalloc(size_t n, size_t size);
+void *perfRealloc(void *p, size_t n);
+#define malloc(n) perfMalloc(n)
+#define calloc(n, size) perfCalloc(n, size)
+#define realloc(p, n) perfRealloc(p, n)
+
+// Built with -DKILO_BENCH the editor can run the headless benchmark, see
+// "bench" at the end.
+#ifdef KILO_BENCH
+#define KILO_BENCH_ROWS 50
+#define KILO_BENCH_COLS 160
+// how long a key may take to be drawn before it counts as lost.
+#define KILO_BENCH_TIMEOUT 60
+#endif
 
 enum editorKey {
     BACKSPACE = 127,
@@ -38,41 +125,755 @@ enum editorKey {
     DEL_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    // a bracketed paste, its text is in E.paste.
+    PASTE_KEY,
 };
 
 /*** data ***/
 
 typedef struct erow {
   int size;
-  int rsize;
+  // bytes chars has room for, see "row storage"; 0 while mapped.
+  int cap;
   char *chars;
-  char *render;
+  // the row's rendering is in E.buf->rcache[rslot] while that slot's tag is
+  // still rtag, see editorRowRender().
+  int rslot;
+  unsigned int rtag;
+  // screen lines the row takes with soft wrap, as last measured: the row
+  // buffer adds these up, see editorRowLines().
+  int wrap;
+  // chars points into the file mapping until the row is first edited.
+  unsigned char mapped;
+  // the highlighter's state at the end of the row, see "syntax
+  // highlighting" below.
+  unsigned char hl_state;
 } erow;
 
-struct editorConfig {  
+// One change in the undo log: text inserted or deleted between row, col
+// and endrow, endcol, or an empty row appended at `row`. The record is
+// followed by the text, padded to a multiple of 8, and then by its total
+// size, so the log can be walked both ways.
+enum undoType {
+    UNDO_INSERT,
+    UNDO_DELETE,
+    UNDO_ROW
+};
+
+enum undoFlags {
+    // undone and redone together with the record before it.
+    UNDO_CHAIN = 1,
+    // typed by hand, the next key may extend it.
+    UNDO_TYPED = 2
+};
+
+typedef struct undoRecord {
+    int type;
+    int flags;
+    int row, col;
+    int endrow, endcol;
+    size_t len;
+} undoRecord;
+
+// Records before `at` are done, the ones from `at` to len were undone and
+// can be redone. saved is `at` as of the last save, or -1 once that state
+// cannot be reached any more.
+struct undoLog {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t at;
+    long long saved;
+    // whether the last record may no longer be extended.
+    int sealed;
+    int replaying;
+    // editorUndoBegin() nesting, whether the open step has a record, and
+    // the offset of its first one.
+    int group;
+    int grouped;
+    size_t open;
+    // whether the open step outgrew KILO_UNDO_MEM, so the rest of it is
+    // not logged.
+    int dropped;
+};
+
+// The journal starts with a header naming the version of the file its
+// changes apply to, followed by one record per change, each followed by
+// its text. sum covers the record and the text, so a record cut short by
+// a crash is not replayed.
+typedef struct journalHead {
+    char magic[8];
+    long long dev, ino, size, sec, nsec;
+} journalHead;
+
+typedef struct journalRecord {
+    int type;
+    int undo;
+    int row, col;
+    int endrow, endcol;
+    unsigned int sum;
+    int pad;
+    long long len;
+} journalRecord;
+
+// A record of type JOURNAL_SAVE holds the bytes a save is about to write
+// over the file in place, after a journalSaveHead with the offset they go
+// to and a checksum of the bytes they replace.
+enum journalType {
+    JOURNAL_SAVE = UNDO_ROW + 1
+};
+
+typedef struct journalSaveHead {
+    long long at;
+    unsigned int old;
+    int pad;
+} journalSaveHead;
+
+// Changes are queued in buf by the main thread; the writer thread swaps
+// it with spare and writes it out. lock guards buf, reset, head and stop.
+struct journal {
+    char *path;
+    int running;
+    int replaying;
+    char *buf;
+    size_t len;
+    size_t cap;
+    char *spare;
+    size_t sparecap;
+    // whether the writer has to start the file over, with head.
+    int reset;
+    journalHead head;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+enum screenAttr {
+    CELL_REVERSE = 1
+};
+
+typedef struct screenCell {
+  // the UTF-8 bytes of the character, padded with NULs; len is 0 in the
+  // columns a wide character covers after its first.
+  char ch[12];
+  unsigned char len;
+  unsigned char attr;
+  unsigned char hl;
+} screenCell;
+
+// Where a character starts, as offsets into chars and into the rendering
+// and as the column it is drawn at.
+// line and col are where the character at the mark would go on screen
+// with soft wrap, before it is moved to the next line for not fitting.
+typedef struct renderMark {
+  int cx;
+  int ri;
+  int rx;
+  int line;
+  int col;
+} renderMark;
+
+typedef struct renderSlot {
+  unsigned int tag;
+  unsigned int used;
+  int len;
+  int cap;
+  char *render;
+  // a mark for the first character at or after every KILO_RENDER_MARK
+  // bytes of chars; marks[0] is the start of the row.
+  renderMark *marks;
+  int nmarks;
+  int markcap;
+  // the screen width the marks wrap at, 0 without soft wrap, and the
+  // screen lines the row then takes.
+  int wrap;
+  int lines;
+  // the highlight class of every rendered column, valid while hl_in is
+  // the state the row starts in; hl_out is the state it ends in.
+  unsigned char *hl;
+  int hl_in;
+  int hl_out;
+} renderSlot;
+
+enum editorHighlight {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER
+};
+
+// Where the tokenizer stands at the end of a row. Every row keeps the
+// state it ended in, so after an edit only the rows from it on are lexed
+// again, up to the first one that ends in the same state as before.
+enum hlState {
+    HLS_UNKNOWN,
+    HLS_NORMAL,
+    HLS_COMMENT
+};
+
+struct editorSyntax {
+    char *filetype;
+    char **filematch;
+    char **keywords;
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    int flags;
+};
+
+// The tokenizer switches on the class of a byte rather than testing it
+// for every kind of token. HC_COMMENT is added to the class of the first
+// byte of a comment delimiter.
+enum hlClass {
+    HC_SPACE,
+    HC_SEP,
+    HC_WORD,
+    HC_DIGIT,
+    HC_QUOTE,
+    HC_COMMENT = 8
+};
+
+typedef struct hlKeyword {
+    const char *word;
+    int len;
+    int type;
+} hlKeyword;
+
+// Tables built from E.buf->syntax when a file type is chosen.
+struct highlighter {
+    unsigned char cls[256];
+    // keywords in an open addressing hash table of kwmask + 1 entries.
+    hlKeyword *kw;
+    unsigned int kwmask;
+    int kwmax;
+    int sclen;
+    int mslen;
+    int melen;
+    // rows lo .. hi - 1 were edited since the last frame, lo is -1 while
+    // none were.
+    int lo;
+    int hi;
+};
+
+// One node of the row buffer: a block of consecutive rows inside a treap
+// that is ordered by position, so every node also knows how many rows its
+// whole subtree holds. A node without rows is a span: n untouched lines of
+// the mapped file starting at line `first`, not read until they are needed.
+// vn and vcount are the same for screen lines with soft wrap; a line of a
+// span counts as one.
+typedef struct ropeNode {
+    struct ropeNode *left, *right;
+    unsigned int prio;
+    int count;
+    int n;
+    int vcount;
+    int vn;
+    int first;
+    erow *rows;
+} ropeNode;
+
+// Line starts found in one KILO_INDEX_CHUNK slice of the mapped file: the
+// chunk holds lines first .. first + nlines - 1, and marks[k] is the offset
+// of its (k * KILO_INDEX_STRIDE)-th line. `first` is only known once every
+// chunk before it has been scanned too.
+typedef struct lineChunk {
+    int ready;
+    int first;
+    int nlines;
+    size_t *marks;
+    // whether the chunk holds a \r, which a save would drop.
+    int cr;
+} lineChunk;
+
+struct fileMap {
+    char *data;
+    size_t len;
+    // the file as it was when mapped, to tell whether it still is.
+    struct stat st;
+    // mapped with room to grow, for -f, see mapFile().
+    int follow;
+    lineChunk *chunks;
+    int nchunks;
+    // chunks whose lines are in the row buffer, the lines they hold, and
+    // whether that is the whole file.
+    int published;
+    int lines;
+    int done;
+    // indexer threads; lock guards next, stop and every chunk's ready flag.
+    pthread_t *workers;
+    int nworkers;
+    int next;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+enum reOp {
+    RE_BYTE,
+    RE_SPLIT,
+    RE_JMP,
+    RE_BOL,
+    RE_EOL,
+    RE_MATCH
+};
+
+// One NFA instruction. RE_BYTE reads a byte in cls and goes on to out,
+// RE_SPLIT goes on to both out and out1, the others read nothing.
+typedef struct reInst {
+    int op;
+    int out, out1;
+    unsigned char cls[32];
+} reInst;
+
+typedef struct reProg {
+    reInst *inst;
+    int n;
+    // whether the pattern matches empty text.
+    int nullable;
+} reProg;
+
+enum reNodeType {
+    RN_EMPTY,
+    RN_CLASS,
+    RN_CAT,
+    RN_ALT,
+    RN_REPEAT,
+    RN_BOL,
+    RN_EOL
+};
+
+// A parsed pattern. RN_REPEAT repeats a between min and max times, with
+// max -1 for no limit.
+typedef struct reNode {
+    int type;
+    int min, max;
+    unsigned char cls[32];
+    struct reNode *a, *b;
+} reNode;
+
+// A DFA state is the set of NFA instructions the scan could be at, sorted.
+typedef struct reState {
+    int *pcs;
+    int n;
+    unsigned int hash;
+    int match;
+    int endmatch;
+} reState;
+
+typedef struct reDFA {
+    reProg *prog;
+    reState **states;
+    int nstates;
+    // trans[(s << 8) | c] is the state after reading c in state s, times
+    // two plus one if it matches, or -1 while not yet built. Scanning a
+    // byte is then a single load.
+    int *trans;
+    // open addressing on the state hashes, holding state index + 1.
+    int *table;
+    int start;
+    // whether the start state matches an empty row.
+    int emptymatch;
+    int flushes;
+    // scratch space for following instructions that read nothing.
+    int *stack;
+    int *list;
+    int nlist;
+    unsigned int *mark;
+    unsigned int gen;
+    // set for a DFA that only follows a match from where it started, see
+    // reMatchEnd().
+    int anchored;
+} reDFA;
+
+typedef struct searchMatch {
+    int row;
+    int col;
+} searchMatch;
+
+// The matches of one chunk of rows, once a helper thread is done with it.
+typedef struct searchChunk {
+    int ready;
+    searchMatch *m;
+    int n;
+} searchChunk;
+
+// The search behind the find prompt. The worker thread reads query, cand
+// and from, and appends to matches; lock guards matches, nmatches,
+// scanned, done and the chunks. cand holds the matches of a shorter
+// query, all of them in rows before `from`.
+struct searchState {
+    int active;
+    // the buffer searched; the thread does not follow E.buf, which the
+    // main thread switches while drawing other windows.
+    struct editorBuffer *buf;
+    char *query;
+    int qlen;
+    int rare;
+    // Ctrl-R in the prompt switches to regex search; then fwd and rev are
+    // the compiled pattern, or error says why it did not compile.
+    int regex;
+    reProg fwd;
+    reProg rev;
+    const char *error;
+    // set for the grep view, which only needs to know the rows that
+    // match: then only the first match of each row is kept.
+    int firstonly;
+    // text every match contains: the query itself, or for a regex the
+    // longest literal run it requires (possibly none). lit[rare] is the
+    // byte the scan looks for.
+    const char *lit;
+    int litlen;
+    char must[KILO_RE_MUST];
+    searchMatch *cand;
+    int ncand;
+    int from;
+    searchMatch *matches;
+    int nmatches;
+    int cap;
+    // every match in rows before `scanned` is in matches.
+    int scanned;
+    int done;
+    volatile int stop;
+    int running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // rows from `from` on, cut into chunks for the helper threads; next is
+    // the first chunk nobody took yet. cond signals a finished chunk.
+    searchChunk *chunks;
+    int nchunks;
+    int next;
+    pthread_cond_t cond;
+    // the match the cursor is on, and what the status bar last showed.
+    int current;
+    int shown;
+};
+
+// One open file: its rows, how they relate to the file on disk, and what
+// goes with them. Any number of windows may show it.
+struct editorBuffer {
+    int dirty;
+    // rows save_lo .. save_hi - 1 may differ from the mapped file, the
+    // rows before them are its first lines and row save_hi on is its line
+    // save_tail on. save_lo is -1 while nothing was changed.
+    int save_lo;
+    int save_hi;
+    int save_tail;
+    int numrows;
+    char *filename;
+    int notify_wd;
+    struct stat filestat;
+    // the file grew since the last frame, see editorFollow().
+    int follow_pending;
+    ropeNode *rope;
+    // the last block editorRowAt() landed in, so walking rows in order
+    // does not descend the tree for every row.
+    ropeNode *rope_hit;
+    int rope_hit_start;
+    // held for reading by the search thread, and for writing by the main
+    // thread while it reshapes the tree during a search.
+    pthread_rwlock_t rope_lock;
+    struct fileMap map;
+    struct undoLog undo;
+    struct journal journal;
+    struct editorSyntax *syntax;
+    struct highlighter hl;
+    // renderings of the rows on screen, see "row operations" below; a
+    // buffer no window shows drops them.
+    renderSlot *rcache;
+    int nrcache;
+    unsigned int rtag;
+    // windows showing the buffer.
+    int windows;
+    struct editorBuffer *next;
+};
+
+// A window's grep view: the rows of its buffer that match query, in
+// order. It shows those and the row with the cursor, whether that one
+// matches or not, and is kept up to date as rows change; see "filter".
+typedef struct viewFilter {
+    char *query;
+    int regex;
+    reProg fwd;
+    reProg rev;
+    reDFA dfa;
+    int *rows;
+    int n;
+    int cap;
+    // the window's soft wrap, which the view turns off, to put back.
+    int wrap;
+} viewFilter;
+
+// A view of a buffer in one part of the screen: its text area is
+// screenrows lines of screencols columns from top, left, with the
+// window's status bar below it.
+struct editorWindow {
+    struct editorBuffer *buf;
     int cx, cy;
     int rx;
     int rowoff;
     int coloff;
-    int dirty;
+    // soft wrap: whether it is on, which screen line of row rowoff is at
+    // the top, and where in its row the cursor was drawn.
+    int wrap;
+    int rowsub;
+    int wrap_line;
+    int wrap_col;
+    int top;
+    int left;
     int screenrows;
     int screencols;
-    int numrows;
-    char *filename;
+    // the screen line of the text at the top and the column at the left
+    // in the shadow frame, -1 when they are not known; see screenFlush().
+    int shadow_top;
+    int shadow_coloff;
+    // the grep view, or NULL; while there is one rowoff counts the lines
+    // of the view rather than rows.
+    viewFilter *filter;
+    struct editorSplit *node;
+    struct editorWindow *next;
+};
+
+// Windows tile the screen above the message bar as the leaves of a tree
+// of splits; a split shares its area between two halves, one above the
+// other or side by side.
+typedef struct editorSplit {
+    struct editorWindow *win;
+    int vertical;
+    struct editorSplit *half[2];
+    struct editorSplit *parent;
+    // its area, see editorLayout().
+    int top, left, rows, cols;
+} editorSplit;
+
+// What the editor counts about its own work. Every thread counts into
+// its own copy without locking, see "perf" below.
+typedef struct perfCounters {
+    long long frames;
+    // time spent drawing frames before they are sent, and what sending
+    // them took.
+    long long build_us;
+    long long flush_bytes;
+    long long flush_writes;
+    long long renders;
+    long long allocs;
+    long long alloc_bytes;
+    // frames that showed new input, and how long after it was read.
+    long long painted;
+    long long paint_us;
+    long long paint_max_us;
+} perfCounters;
+
+__thread perfCounters perf;
+
+struct editorConfig {
+    // the window keys go to and its buffer. Drawing and the work done
+    // for other buffers switch these for a while, see editorUseWindow().
+    struct editorWindow *win;
+    struct editorBuffer *buf;
+    struct editorWindow *focus;
+    struct editorWindow *windows;
+    struct editorBuffer *buffers;
+    editorSplit *layout;
+    // terminal size.
+    int termrows;
+    int termcols;
     char statusmsg[80];
     // time_t comes from <time.h>.
     time_t statusmsg_time;
-    erow *row;
+    int statusmsg_shown;
+    // colors the terminal takes: 16, 256, or 1 << 24 for 24-bit color.
+    int colors;
+    // input read ahead of the key parser, and the event loop's state.
+    char inbuf[4096];
+    int inlen;
+    int inpos;
+    int wake[2];
+    volatile sig_atomic_t winch;
+    int notify_fd;
+    long long redraw_at;
+    long long last_frame;
+    char *paste;
+    size_t pastelen;
+    size_t pastecap;
+    unsigned int rope_seed;
+    struct searchState search;
+    unsigned int frame;
+    // the frame being drawn and the one the terminal currently shows, and
+    // the part of it the screen functions draw into, see screenRegion().
+    screenCell *screen;
+    screenCell *shadow;
+    int screen_lines;
+    int screen_cols;
+    int shadow_valid;
+    int clip_top;
+    int clip_left;
+    int clip_cols;
+    // when input waiting to be painted was read, 0 when there is none;
+    // and what was counted from the end of one frame to the end of the
+    // next, handling the keys included, for the overlay.
+    long long input_at;
+    int perf_overlay;
+    perfCounters perf_mark;
+    perfCounters perf_frame;
+    long long perf_paint_us;
     struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+/*** filetypes ***/
+
+// Keywords ending in | are highlighted as types.
+char *C_HL_extensions[] = { ".c", ".h", ".cpp", ".cc", ".hpp", NULL };
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case",
+    "default", "do", "goto", "sizeof", "const", "volatile", "extern",
+    "register", "inline", "#include", "#define", "#if", "#ifdef",
+    "#ifndef", "#else", "#endif",
+
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "size_t|", "ssize_t|", NULL
+};
+
+char *PY_HL_extensions[] = { ".py", NULL };
+char *PY_HL_keywords[] = {
+    "and", "as", "assert", "break", "class", "continue", "def", "del",
+    "elif", "else", "except", "finally", "for", "from", "global", "if",
+    "import", "in", "is", "lambda", "nonlocal", "not", "or", "pass",
+    "raise", "return", "try", "while", "with", "yield",
+
+    "True|", "False|", "None|", "self|", NULL
+};
+
+struct editorSyntax HLDB[] = {
+    {
+        "c",
+        C_HL_extensions,
+        C_HL_keywords,
+        "//", "/*", "*/",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    },
+    {
+        "python",
+        PY_HL_extensions,
+        PY_HL_keywords,
+        "#", NULL, NULL,
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int empty);
+void editorUpdateRow(erow *row, int at);
+void editorFreeRow(erow *row);
+void mapStartWorkers(struct fileMap *m);
+int editorIndexPublish();
+int getWindowSize(int *rows, int *cols);
+void editorFileEvent();
+void undoAdd(int type, int flags, int row, int col, int endrow, int endcol, const char *s, size_t len);
+void undoTyped(int type, int row, int col, const char *s, int len);
+void journalAdd(int type, int undo, int row, int col, int endrow, int endcol, const char *s, size_t len);
+void editorIndexAll();
+void editorSearchStop();
+int editorSearchPoll();
+int editorTopLine();
+void editorUseWindow(struct editorWindow *w);
+void editorLayoutAll();
+void filterEdit(int at, int removed, int added);
+int savePwrite(int fd, const char *buf, size_t len, off_t at);
+int editorRemap(const char *path, int keep, int resume);
+int editorSaveFull(const char *target, long long *written, const char *patch, size_t at, size_t len);
+#ifdef KILO_BENCH
+void benchFrame();
+int benchMain(int argc, char *argv[]);
+#endif
+
+/*** perf ***/
+
+// Counters are plain fields of the thread's own perfCounters, so counting
+// costs an increment. A thread adds its counts to perf_done when it ends;
+// the totals are the main thread's counts and those. Ctrl-P shows what the
+// last frame counted in the status bar, and with KILO_PERF naming a file
+// the totals are appended to it on exit.
+
+perfCounters perf_done;
+
+long long perfMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void *perfMalloc(size_t n) {
+    perf.allocs++;
+    perf.alloc_bytes += n;
+    return (malloc)(n);
+}
+
+void *perfCalloc(size_t n, size_t size) {
+    perf.allocs++;
+    perf.alloc_bytes += n * size;
+    return (calloc)(n, size);
+}
+
+void *perfRealloc(void *p, size_t n) {
+    perf.allocs++;
+    perf.alloc_bytes += n;
+    return (realloc)(p, n);
+}
+
+// Called by a thread as it ends.
+void perfMerge() {
+    __sync_fetch_and_add(&perf_done.renders, perf.renders);
+    __sync_fetch_and_add(&perf_done.allocs, perf.allocs);
+    __sync_fetch_and_add(&perf_done.alloc_bytes, perf.alloc_bytes);
+    memset(&perf, 0, sizeof(perf));
+}
+
+// Counts of the main thread since `from`, or in total with the threads
+// that ended when from is NULL.
+void perfSince(perfCounters *d, const perfCounters *from) {
+    *d = perf;
+    if (from) {
+        d->frames -= from->frames;
+        d->build_us -= from->build_us;
+        d->flush_bytes -= from->flush_bytes;
+        d->flush_writes -= from->flush_writes;
+        d->renders -= from->renders;
+        d->allocs -= from->allocs;
+        d->alloc_bytes -= from->alloc_bytes;
+        d->painted -= from->painted;
+        d->paint_us -= from->paint_us;
+    } else {
+        d->renders += perf_done.renders;
+        d->allocs += perf_done.allocs;
+        d->alloc_bytes += perf_done.alloc_bytes;
+    }
+}
+
+void perfDump() {
+    const char *path = getenv("KILO_PERF");
+    FILE *fp = path ? fopen(path, "a") : NULL;
+    if (fp == NULL) return;
+    perfCounters t;
+    perfSince(&t, NULL);
+    fprintf(fp, "session pid %d time %lld\n", (int)getpid(), (long long)time(NULL));
+    fprintf(fp, "frames %lld\nbuild_us %lld\nflush_bytes %lld\nflush_writes %lld\n",
+        t.frames, t.build_us, t.flush_bytes, t.flush_writes);
+    fprintf(fp, "renders %lld\nallocs %lld\nalloc_bytes %lld\n", t.renders, t.allocs, t.alloc_bytes);
+    fprintf(fp, "painted %lld\npaint_us %lld\npaint_max_us %lld\n", t.painted, t.paint_us, t.paint_max_us);
+    fclose(fp);
+}
 
 /*** terminal ***/
 
@@ -96,6 +897,7 @@ void print_binary(unsigned int number) {
 }
 
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -118,28 +920,200 @@ void enableRawMode() {
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
     // minimum number of bytes of input needed before read() can return.
     raw.c_cc[VMIN] = 0;
-    // maximum amount of time to wait before read() returns.
-    raw.c_cc[VTIME] = 1;
+    // maximum amount of time to wait before read() returns. The event loop
+    // only reads once poll() says there is input, so it never waits.
+    raw.c_cc[VTIME] = 0;
     
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    // Have the terminal mark pasted text with \x1b[200~ ... \x1b[201~, so
+    // a paste arrives as one PASTE_KEY instead of a key per byte.
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+// Everything the editor waits for goes through one poll(): keys, a wakeup
+// pipe written by the SIGWINCH handler and by worker threads, file change
+// notifications, and the deadline of the next timed redraw. With nothing
+// scheduled it sleeps without a timeout, so an idle editor uses no CPU.
+
+long long editorNow() {
+    // clock_gettime() comes from <time.h>.
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void editorWake() {
+    // Called from worker threads and the signal handler. A full pipe
+    // already holds a pending wakeup, so a failed write is fine.
+    if (E.wake[1] != -1 && write(E.wake[1], "w", 1) == -1) return;
+}
+
+void editorHandleWinch(int sig) {
+    (void)sig;
+    E.winch = 1;
+    editorWake();
+}
+
+// Ask for a frame no sooner than KILO_FRAME_MS after the last one, so
+// bursts of background events are drawn at most once per frame interval.
+void editorScheduleRedraw() {
+    if (E.redraw_at) return;
+    long long at = E.last_frame + KILO_FRAME_MS;
+    long long now = editorNow();
+    E.redraw_at = at > now ? at : now;
+}
+
+// Milliseconds until something needs drawing without any input, or -1.
+int editorNextTimeout() {
+    long long now = editorNow();
+    long long at = E.redraw_at;
+    if (E.statusmsg[0] && E.statusmsg_shown) {
+        // The message bar clears itself KILO_STATUS_SECS after being set.
+        long long left = (E.statusmsg_time + KILO_STATUS_SECS - time(NULL)) * 1000LL;
+        if (left < 0) left = 0;
+        if (at == 0 || now + left < at) at = now + left;
+    }
+    if (at == 0) return -1;
+    return at > now ? (int)(at - now) : 0;
+}
+
+void editorHandleResize() {
+    E.winch = 0;
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1 || rows < 3 || cols < 1) return;
+    E.termrows = rows;
+    E.termcols = cols;
+    editorLayoutAll();
+}
+
+// Read whatever input is available into the input buffer.
+void editorReadInput() {
+    if (E.inpos == E.inlen) E.inpos = E.inlen = 0;
+    if (E.inpos > 0 && E.inlen == (int)sizeof(E.inbuf)) {
+        memmove(E.inbuf, &E.inbuf[E.inpos], E.inlen - E.inpos);
+        E.inlen -= E.inpos;
+        E.inpos = 0;
+    }
+    if (E.inlen == (int)sizeof(E.inbuf)) return;
+    int n = read(STDIN_FILENO, &E.inbuf[E.inlen], sizeof(E.inbuf) - E.inlen);
+    if (n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (n > 0) {
+        E.inlen += n;
+        if (E.input_at == 0) E.input_at = perfMicros();
+    }
+}
+
+// Run the event loop until there is input, or for at most timeout ms when
+// timeout is not -1. Returns 1 when input arrived.
+int editorWaitInput(int timeout) {
+    long long until = timeout == -1 ? 0 : editorNow() + timeout;
+    while (1) {
+        struct pollfd fds[3];
+        int nfds = 0;
+        fds[nfds].fd = STDIN_FILENO;
+        fds[nfds++].events = POLLIN;
+        fds[nfds].fd = E.wake[0];
+        fds[nfds++].events = POLLIN;
+        if (E.notify_fd != -1) {
+            fds[nfds].fd = E.notify_fd;
+            fds[nfds++].events = POLLIN;
+        }
+
+        int wait = editorNextTimeout();
+        if (timeout != -1) {
+            long long left = until - editorNow();
+            if (left < 0) left = 0;
+            if (wait == -1 || left < wait) wait = left;
+        }
+
+        if (poll(fds, nfds, wait) == -1) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(E.wake[0], drain, sizeof(drain)) > 0);
+        }
+        if (E.winch) {
+            editorHandleResize();
+            editorScheduleRedraw();
+        }
+        struct editorBuffer *cur = E.buf;
+        for (E.buf = E.buffers; E.buf; E.buf = E.buf->next) {
+            if (!E.buf->map.done && editorIndexPublish()) editorScheduleRedraw();
+        }
+        E.buf = cur;
+        if (editorSearchPoll()) editorScheduleRedraw();
+        if (nfds > 2 && (fds[2].revents & POLLIN)) editorFileEvent();
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            editorReadInput();
+            if (E.inpos < E.inlen) return 1;
+        }
+        if (editorNextTimeout() == 0) editorRefreshScreen();
+        if (timeout != -1 && editorNow() >= until) return 0;
+    }
+}
+
+int editorInputPending() {
+    return E.inpos < E.inlen;
+}
+
+// Next input byte, waiting up to timeout ms (-1 waits for good). Returns
+// -1 if nothing arrived in time.
+int inputByte(int timeout) {
+    if (E.inpos == E.inlen && !editorWaitInput(timeout)) return -1;
+    return (unsigned char)E.inbuf[E.inpos++];
+}
+
+void editorPasteAppend(const char *s, size_t len) {
+    if (E.pastelen + len > E.pastecap) {
+        while (E.pastelen + len > E.pastecap) E.pastecap = E.pastecap ? E.pastecap * 2 : 4096;
+        E.paste = realloc(E.paste, E.pastecap);
+        if (E.paste == NULL) die("realloc");
+    }
+    memcpy(&E.paste[E.pastelen], s, len);
+    E.pastelen += len;
+}
+
+// Collect pasted text up to the closing \x1b[201~ into E.paste. Text
+// between escapes is copied straight out of the input buffer.
+void editorReadPaste() {
+    static const char end[] = "\x1b[201~";
+    E.pastelen = 0;
+    while (1) {
+        if (E.inpos == E.inlen && !editorWaitInput(-1)) continue;
+        char *s = &E.inbuf[E.inpos];
+        char *esc = memchr(s, '\x1b', E.inlen - E.inpos);
+        int run = esc ? esc - s : E.inlen - E.inpos;
+        editorPasteAppend(s, run);
+        E.inpos += run;
+        if (esc == NULL) continue;
+
+        int k = 0;
+        int c;
+        while (k < 6 && (c = inputByte(-1)) == end[k]) k++;
+        if (k == 6) return;
+        // Not the end marker after all: keep what matched so far and look
+        // at the mismatching byte again, it may start the marker itself.
+        editorPasteAppend(end, k);
+        E.inpos--;
     }
+}
+
+int editorReadKey() {
+    int c = inputByte(-1);
 
     if (c == '\x1b') {
-        char seq[3];
+        int seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if ((seq[0] = inputByte(KILO_ESC_WAIT)) == -1) return '\x1b';
+        if ((seq[1] = inputByte(KILO_ESC_WAIT)) == -1) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if ((seq[2] = inputByte(KILO_ESC_WAIT)) == -1) return '\x1b';
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1': return HOME_KEY;
@@ -150,6 +1124,11 @@ int editorReadKey() {
                         case '7': return HOME_KEY;
                         case '8': return END_KEY;
                     }
+                } else if (seq[1] == '2' && seq[2] == '0') {
+                    if (inputByte(KILO_ESC_WAIT) == '0' && inputByte(KILO_ESC_WAIT) == '~') {
+                        editorReadPaste();
+                        return PASTE_KEY;
+                    }
                 }
             } else {
                 switch (seq[1]) {
@@ -181,13 +1160,13 @@ int getCursorPosition(int *rows, int *cols) {
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+        int c = inputByte(KILO_ESC_WAIT * 4);
+        if (c == -1) break;
+        buf[i] = c;
         if (buf[i] == 'R') break;
         i++;
     }
     buf[i] = '\0';
-    printf("\r\n&buf[1]: '%s'\r\n", &buf[1]);
-    
     if (buf[0] != '\x1b' || buf[1] != '[') return -1;
     // sscanf() comes from <stdio.h>.
     if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
@@ -199,433 +1178,5474 @@ int getWindowSize(int *rows, int *cols) {
     struct winsize ws;
 
     // ioctl(), TIOCGWINSZ, and struct winsize come from <sys/ioctl.h>.
-    if (1 || ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        if (DEBUG) printf("[DEBUG]: getWindowSize - if\n");
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
         if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
-        // if (DEBUG) printf("<\n");
-        // editorReadKey();
         return getCursorPosition(rows, cols);
-        editorReadKey();
-        return -1;
     } else {
-        if (DEBUG) printf("[DEBUG]: getWindowSize - else");
         *cols = ws.ws_col;
         *rows = ws.ws_row;
-        if (DEBUG) printf("[DEBUG]: cols:%d, rows:%d", ws.ws_col, ws.ws_row);
         return 0;
     }
 }
 
-/*** row operations ***/ 
+/*** file map ***/
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j = 0;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+// Opened files are mapped read-only and only the start offsets of lines
+// are indexed, sparsely. Indexer threads scan the chunks of the mapping in
+// parallel; the main thread publishes finished chunks in file order, so
+// the rows already indexed can be shown while the rest is still scanned.
+
+void mapAddLine(lineChunk *c, int *cap, size_t line) {
+    if (c->nlines % KILO_INDEX_STRIDE == 0) {
+        if (c->nlines / KILO_INDEX_STRIDE == *cap) {
+            *cap = *cap ? *cap * 2 : 16;
+            c->marks = realloc(c->marks, sizeof(size_t) * *cap);
+            if (c->marks == NULL) die("realloc");
         }
-        rx++;
+        c->marks[c->nlines / KILO_INDEX_STRIDE] = line;
     }
-    return rx;
+    c->nlines++;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx = 0;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+// Add the line starts right after the newlines in [q, qend) to c.
+void mapScanLines(struct fileMap *m, lineChunk *c, int *cap, size_t q, size_t qend) {
+    const char *data = m->data;
+
+#ifdef __SSE2__
+    // Compare 16 bytes at a time and only walk the newline bits one by one
+    // when one of them is due for a mark.
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (q + 16 <= qend) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&data[q]);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask) {
+            int rest = c->nlines % KILO_INDEX_STRIDE;
+            int free_lines = rest ? KILO_INDEX_STRIDE - rest : 0;
+            int count = __builtin_popcount(mask);
+            if (count <= free_lines) {
+                c->nlines += count;
+            } else {
+                while (mask) {
+                    mapAddLine(c, cap, q + __builtin_ctz(mask) + 1);
+                    mask &= mask - 1;
+                }
+            }
+        }
+        q += 16;
+    }
+#endif
+
+    while (q < qend) {
+        const char *p = memchr(&data[q], '\n', qend - q);
+        if (p == NULL) break;
+        q = p - data + 1;
+        mapAddLine(c, cap, q);
+    }
+}
+
+void mapScanChunk(struct fileMap *m, lineChunk *c, size_t start) {
+    size_t end = start + KILO_INDEX_CHUNK;
+    if (end > m->len) end = m->len;
+
+    int cap = 0;
+    c->nlines = 0;
+    c->marks = NULL;
+
+    // A line starts at offset 0 and right after every '\n' that is not the
+    // last byte of the file; this chunk owns the starts in [start, end), so
+    // it looks at the newlines in [start - 1, end - 1).
+    if (start == 0) mapAddLine(c, &cap, 0);
+    mapScanLines(m, c, &cap, start ? start - 1 : 0, end - 1);
+    c->cr = memchr(&m->data[start], '\r', end - start) != NULL;
+}
+
+void *mapIndexWorker(void *arg) {
+    struct fileMap *m = arg;
+    while (1) {
+        // pthread_mutex_lock() and friends come from <pthread.h>.
+        pthread_mutex_lock(&m->lock);
+        int k = -1;
+        if (!m->stop && m->next < m->nchunks) k = m->next++;
+        pthread_mutex_unlock(&m->lock);
+        if (k == -1) {
+            perfMerge();
+            return NULL;
         }
-        cur_rx++;
 
-        if (cur_rx > rx) return cx;
+        lineChunk *c = &m->chunks[k];
+        mapScanChunk(m, c, (size_t)k * KILO_INDEX_CHUNK);
+
+        pthread_mutex_lock(&m->lock);
+        c->ready = 1;
+        pthread_cond_broadcast(&m->cond);
+        pthread_mutex_unlock(&m->lock);
+        editorWake();
+    }
+}
+
+void mapStartIndexer(struct fileMap *m) {
+    m->nchunks = (m->len + KILO_INDEX_CHUNK - 1) / KILO_INDEX_CHUNK;
+    m->chunks = calloc(m->nchunks, sizeof(lineChunk));
+    if (m->chunks == NULL) die("calloc");
+    m->next = 0;
+    m->published = 0;
+    m->stop = 0;
+    m->done = 0;
+    mapStartWorkers(m);
+}
+
+void mapStartWorkers(struct fileMap *m) {
+    // sysconf() comes from <unistd.h>.
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    if (ncpu > KILO_INDEX_THREADS) ncpu = KILO_INDEX_THREADS;
+    if (ncpu > m->nchunks - m->next) ncpu = m->nchunks - m->next;
+
+    m->workers = malloc(sizeof(pthread_t) * ncpu);
+    if (m->workers == NULL) die("malloc");
+    m->nworkers = 0;
+    while (m->nworkers < ncpu &&
+           pthread_create(&m->workers[m->nworkers], NULL, mapIndexWorker, m) == 0)
+        m->nworkers++;
+}
+
+void mapStopIndexer(struct fileMap *m) {
+    pthread_mutex_lock(&m->lock);
+    m->stop = 1;
+    pthread_mutex_unlock(&m->lock);
+    while (m->nworkers > 0) pthread_join(m->workers[--m->nworkers], NULL);
+    free(m->workers);
+    m->workers = NULL;
+}
+
+// Block until chunk k has been scanned. Without indexer threads (none
+// could be started) the caller scans it itself.
+void mapWaitChunk(struct fileMap *m, int k) {
+    lineChunk *c = &m->chunks[k];
+    pthread_mutex_lock(&m->lock);
+    if (m->nworkers == 0 && m->next == k) {
+        m->next++;
+        pthread_mutex_unlock(&m->lock);
+        mapScanChunk(m, c, (size_t)k * KILO_INDEX_CHUNK);
+        pthread_mutex_lock(&m->lock);
+        c->ready = 1;
+    }
+    while (!c->ready) pthread_cond_wait(&m->cond, &m->lock);
+    pthread_mutex_unlock(&m->lock);
+}
+
+// The mapping grew from old to m->len bytes, as a followed file does.
+// The new bytes up to the end of the last chunk are scanned here, chunks
+// for the rest are left to the indexer like those of a newly opened file.
+// Returns how many lines the last chunk gained.
+int mapGrow(struct fileMap *m, size_t old) {
+    int added = 0;
+    if (m->nchunks > 0) {
+        lineChunk *c = &m->chunks[m->nchunks - 1];
+        size_t end = (size_t)m->nchunks * KILO_INDEX_CHUNK;
+        if (end > m->len) end = m->len;
+        if (end > old) {
+            // marks has room for at least the marks it holds.
+            int n = c->nlines;
+            int cap = (n + KILO_INDEX_STRIDE - 1) / KILO_INDEX_STRIDE;
+            mapScanLines(m, c, &cap, old - 1, end - 1);
+            if (memchr(&m->data[old], '\r', end - old)) c->cr = 1;
+            added = c->nlines - n;
+        }
+    }
+
+    int nchunks = (m->len + KILO_INDEX_CHUNK - 1) / KILO_INDEX_CHUNK;
+    if (nchunks > m->nchunks) {
+        m->chunks = realloc(m->chunks, sizeof(lineChunk) * nchunks);
+        if (m->chunks == NULL) die("realloc");
+        memset(&m->chunks[m->nchunks], 0, sizeof(lineChunk) * (nchunks - m->nchunks));
+        m->next = m->nchunks;
+        m->nchunks = nchunks;
+        m->stop = 0;
+        m->done = 0;
+        // A frame's worth of growth is scanned by whoever waits for it.
+        if (nchunks - m->next > 1) mapStartWorkers(m);
+    }
+    return added;
+}
+
+// Map the first size bytes of fd. A followed file is mapped at the start
+// of KILO_FOLLOW_RESERVE bytes of address space that it may grow into,
+// since rows point into the mapping and it must not move.
+void *mapFile(struct fileMap *m, int fd, size_t size) {
+    if (!m->follow) return size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (size > KILO_FOLLOW_RESERVE) return MAP_FAILED;
+    char *data = mmap(NULL, KILO_FOLLOW_RESERVE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED || size == 0) return data;
+    if (mmap(data, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(data, KILO_FOLLOW_RESERVE);
+        return MAP_FAILED;
+    }
+    return data;
+}
+
+void mapUnmap(struct fileMap *m) {
+    // munmap() comes from <sys/mman.h>.
+    if (m->data) munmap(m->data, m->follow ? KILO_FOLLOW_RESERVE : m->len);
+}
+
+size_t mapLineOffset(struct fileMap *m, int line) {
+    int lo = 0, hi = m->published - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (m->chunks[mid].first <= line) lo = mid;
+        else hi = mid - 1;
+    }
+    lineChunk *c = &m->chunks[lo];
+    int local = line - c->first;
+    size_t p = c->marks[local / KILO_INDEX_STRIDE];
+    int skip = local % KILO_INDEX_STRIDE;
+    while (skip--) p = (char *)memchr(&m->data[p], '\n', m->len - p) - m->data + 1;
+    return p;
+}
+
+// Offset of a line, or the end of the file for the line after the last.
+size_t mapLineStart(struct fileMap *m, int line) {
+    return line < m->lines ? mapLineOffset(m, line) : m->len;
+}
+
+// Length of the line starting at p, without its line terminator. Returns
+// the offset of the next line in *next.
+int mapLineLength(struct fileMap *m, size_t p, size_t *next) {
+    char *nl = memchr(&m->data[p], '\n', m->len - p);
+    size_t end = nl ? (size_t)(nl - m->data) : m->len;
+    *next = nl ? end + 1 : end;
+    while (end > p && m->data[end - 1] == '\r') end--;
+    return end - p;
+}
+
+void mapClose(struct fileMap *m) {
+    mapStopIndexer(m);
+    int i;
+    for (i = 0; i < m->nchunks; i++) free(m->chunks[i].marks);
+    free(m->chunks);
+    mapUnmap(m);
+    m->data = NULL;
+    m->len = 0;
+    m->chunks = NULL;
+    m->nchunks = 0;
+    m->published = 0;
+    m->lines = 0;
+    m->done = 1;
+}
+
+/*** row buffer ***/
+
+// Rows are kept in blocks of up to KILO_BLOCK_ROWS inside a treap, so
+// inserting or deleting a line only moves rows of one block plus O(log n)
+// tree nodes, wherever it happens in the file.
+
+int ropeCount(ropeNode *t) {
+    return t ? t->count : 0;
+}
+
+int ropeLines(ropeNode *t) {
+    return t ? t->vcount : 0;
+}
+
+void ropeUpdate(ropeNode *t) {
+    t->count = ropeCount(t->left) + t->n + ropeCount(t->right);
+    t->vcount = ropeLines(t->left) + t->vn + ropeLines(t->right);
+}
+
+// Screen lines of rows at .. at + n - 1 of block t.
+int ropeBlockLines(ropeNode *t, int at, int n) {
+    if (t->rows == NULL) return n;
+    int j, lines = 0;
+    for (j = at; j < at + n; j++) lines += t->rows[j].wrap;
+    return lines;
+}
+
+unsigned int ropeRandom() {
+    // xorshift32, priorities only need to be well spread, not secure.
+    unsigned int x = E.rope_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    E.rope_seed = x;
+    return x;
+}
+
+ropeNode *ropeNewSpan(int first, int n) {
+    ropeNode *t = malloc(sizeof(ropeNode));
+    if (t == NULL) die("malloc");
+    t->left = t->right = NULL;
+    t->prio = ropeRandom();
+    t->n = n;
+    t->count = n;
+    t->vn = n;
+    t->vcount = n;
+    t->first = first;
+    t->rows = NULL;
+    return t;
+}
+
+ropeNode *ropeNewNode() {
+    ropeNode *t = ropeNewSpan(-1, 0);
+    t->rows = malloc(sizeof(erow) * KILO_BLOCK_ROWS);
+    if (t->rows == NULL) die("malloc");
+    return t;
+}
+
+void ropeFreeNode(ropeNode *t) {
+    free(t->rows);
+    free(t);
+}
+
+// Free a whole tree and the rows in it.
+void ropeFree(ropeNode *t) {
+    if (t == NULL) return;
+    ropeFree(t->left);
+    ropeFree(t->right);
+    if (t->rows) {
+        int j;
+        for (j = 0; j < t->n; j++) editorFreeRow(&t->rows[j]);
+    }
+    ropeFreeNode(t);
+}
+
+ropeNode *ropeRotateRight(ropeNode *t) {
+    ropeNode *l = t->left;
+    t->left = l->right;
+    l->right = t;
+    ropeUpdate(t);
+    ropeUpdate(l);
+    return l;
+}
+
+ropeNode *ropeRotateLeft(ropeNode *t) {
+    ropeNode *r = t->right;
+    t->right = r->left;
+    r->left = t;
+    ropeUpdate(t);
+    ropeUpdate(r);
+    return r;
+}
+
+ropeNode *ropeInsertFirst(ropeNode *t, ropeNode *nn) {
+    if (t == NULL) return nn;
+    t->left = ropeInsertFirst(t->left, nn);
+    if (t->left->prio > t->prio) return ropeRotateRight(t);
+    ropeUpdate(t);
+    return t;
+}
+
+ropeNode *ropeInsertLast(ropeNode *t, ropeNode *nn) {
+    if (t == NULL) return nn;
+    t->right = ropeInsertLast(t->right, nn);
+    if (t->right->prio > t->prio) return ropeRotateLeft(t);
+    ropeUpdate(t);
+    return t;
+}
+
+// Restore the heap order below t after its children changed.
+ropeNode *ropeSiftDown(ropeNode *t) {
+    ropeNode *l = t->left, *r = t->right;
+    if (l && l->prio > t->prio && (r == NULL || l->prio >= r->prio)) {
+        t = ropeRotateRight(t);
+        t->right = ropeSiftDown(t->right);
+    } else if (r && r->prio > t->prio) {
+        t = ropeRotateLeft(t);
+        t->left = ropeSiftDown(t->left);
+    } else {
+        return t;
+    }
+    ropeUpdate(t);
+    return t;
+}
+
+// Turn the lines of span t around offset `at` into real rows; whatever is
+// left of the span on either side moves into new span nodes.
+ropeNode *ropeSplitSpan(ropeNode *t, int at) {
+    int b = at - at % (KILO_BLOCK_ROWS / 2);
+    int m = t->n - b;
+    if (m > KILO_BLOCK_ROWS / 2) m = KILO_BLOCK_ROWS / 2;
+
+    if (b > 0)
+        t->left = ropeInsertLast(t->left, ropeNewSpan(t->first, b));
+    if (b + m < t->n)
+        t->right = ropeInsertFirst(t->right, ropeNewSpan(t->first + b + m, t->n - b - m));
+
+    t->rows = malloc(sizeof(erow) * KILO_BLOCK_ROWS);
+    if (t->rows == NULL) die("malloc");
+    t->first += b;
+    t->n = m;
+
+    size_t p = mapLineOffset(&E.buf->map, t->first);
+    int j;
+    for (j = 0; j < m; j++) {
+        erow *row = &t->rows[j];
+        row->chars = &E.buf->map.data[p];
+        row->size = mapLineLength(&E.buf->map, p, &p);
+        row->cap = 0;
+        row->mapped = 1;
+        row->hl_state = HLS_UNKNOWN;
+        row->rtag = 0;
+        row->wrap = 1;
+    }
+    t->first = -1;
+    t->vn = m;
+
+    ropeUpdate(t);
+    return ropeSiftDown(t);
+}
+
+ropeNode *ropeMaterialize(ropeNode *t, int at) {
+    int lc = ropeCount(t->left);
+    if (at < lc) {
+        t->left = ropeMaterialize(t->left, at);
+        if (t->left->prio > t->prio) return ropeRotateRight(t);
+    } else if (at >= lc + t->n) {
+        t->right = ropeMaterialize(t->right, at - lc - t->n);
+        if (t->right->prio > t->prio) return ropeRotateLeft(t);
+    } else if (t->rows == NULL) {
+        return ropeSplitSpan(t, at - lc);
+    }
+    ropeUpdate(t);
+    return t;
+}
+
+// Append n freshly indexed file lines, starting at line `first`.
+ropeNode *ropeAppendSpan(ropeNode *t, int first, int n) {
+    ropeNode *last = t;
+    while (last && last->right) last = last->right;
+    if (last && last->rows == NULL && last->first + last->n == first) {
+        // Grow the trailing span in place, only the right spine counts change.
+        for (last = t; last; last = last->right) {
+            last->count += n;
+            last->vcount += n;
+            if (last->right == NULL) {
+                last->n += n;
+                last->vn += n;
+            }
+        }
+        return t;
+    }
+    return ropeInsertLast(t, ropeNewSpan(first, n));
+}
+
+ropeNode *ropeMerge(ropeNode *a, ropeNode *b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+    if (a->prio > b->prio) {
+        a->right = ropeMerge(a->right, b);
+        ropeUpdate(a);
+        return a;
+    }
+    b->left = ropeMerge(a, b->left);
+    ropeUpdate(b);
+    return b;
+}
+
+// Cut t into the rows before `at` and the rest. A block or span that
+// straddles the cut is divided in two.
+void ropeSplit(ropeNode *t, int at, ropeNode **l, ropeNode **r) {
+    if (t == NULL) {
+        *l = *r = NULL;
+        return;
+    }
+
+    int lc = ropeCount(t->left);
+    if (at <= lc) {
+        ropeSplit(t->left, at, l, &t->left);
+        ropeUpdate(t);
+        *r = t;
+    } else if (at >= lc + t->n) {
+        ropeSplit(t->right, at - lc - t->n, &t->right, r);
+        ropeUpdate(t);
+        *l = t;
+    } else {
+        int off = at - lc;
+        ropeNode *nn;
+        if (t->rows == NULL) {
+            nn = ropeNewSpan(t->first + off, t->n - off);
+        } else {
+            nn = ropeNewNode();
+            nn->n = t->n - off;
+            nn->vn = ropeBlockLines(t, off, nn->n);
+            memcpy(nn->rows, &t->rows[off], sizeof(erow) * nn->n);
+        }
+        // The upper part takes over t's priority and right subtree, so
+        // both halves are still heaps.
+        nn->prio = t->prio;
+        nn->right = t->right;
+        t->right = NULL;
+        t->n = off;
+        t->vn -= nn->vn;
+        ropeUpdate(t);
+        ropeUpdate(nn);
+        *l = t;
+        *r = nn;
+    }
+}
+
+void ropeBlockInsert(ropeNode *t, int at, erow *row) {
+    memmove(&t->rows[at + 1], &t->rows[at], sizeof(erow) * (t->n - at));
+    t->rows[at] = *row;
+    t->n++;
+    t->vn += row->wrap;
+}
+
+ropeNode *ropeInsertRow(ropeNode *t, int at, erow *row) {
+    if (t == NULL) {
+        t = ropeNewNode();
+        ropeBlockInsert(t, 0, row);
+        ropeUpdate(t);
+        return t;
+    }
+
+    int lc = ropeCount(t->left);
+    if (t->rows == NULL && at >= lc && at <= lc + t->n) {
+        int off = at - lc;
+        t = ropeSplitSpan(t, off < t->n ? off : t->n - 1);
+        return ropeInsertRow(t, at, row);
+    }
+    if (at < lc) {
+        t->left = ropeInsertRow(t->left, at, row);
+        if (t->left->prio > t->prio) return ropeRotateRight(t);
+    } else if (at > lc + t->n) {
+        t->right = ropeInsertRow(t->right, at - lc - t->n, row);
+        if (t->right->prio > t->prio) return ropeRotateLeft(t);
+    } else if (t->n < KILO_BLOCK_ROWS) {
+        ropeBlockInsert(t, at - lc, row);
+    } else {
+        // The block is full: move its upper half into a new node that
+        // becomes the in-order successor of this one.
+        ropeNode *nn = ropeNewNode();
+        int half = t->n / 2;
+        nn->n = t->n - half;
+        nn->vn = ropeBlockLines(t, half, nn->n);
+        memcpy(nn->rows, &t->rows[half], sizeof(erow) * nn->n);
+        t->n = half;
+        t->vn -= nn->vn;
+
+        at -= lc;
+        if (at > half) ropeBlockInsert(nn, at - half, row);
+        else ropeBlockInsert(t, at, row);
+        ropeUpdate(nn);
+
+        t->right = ropeInsertFirst(t->right, nn);
+        if (t->right->prio > t->prio) return ropeRotateLeft(t);
+    }
+    ropeUpdate(t);
+    return t;
+}
+
+ropeNode *ropeDeleteRow(ropeNode *t, int at) {
+    int lc = ropeCount(t->left);
+    if (at < lc) {
+        t->left = ropeDeleteRow(t->left, at);
+    } else if (at >= lc + t->n) {
+        t->right = ropeDeleteRow(t->right, at - lc - t->n);
+    } else {
+        at -= lc;
+        t->vn -= t->rows[at].wrap;
+        memmove(&t->rows[at], &t->rows[at + 1], sizeof(erow) * (t->n - at - 1));
+        t->n--;
+        if (t->n == 0) {
+            ropeNode *rest = ropeMerge(t->left, t->right);
+            ropeFreeNode(t);
+            return rest;
+        }
+    }
+    ropeUpdate(t);
+    return t;
+}
+
+// Node holding row `at`; its first row goes to *start.
+ropeNode *ropeLocate(ropeNode *t, int at, int *start) {
+    *start = 0;
+    while (t) {
+        int lc = ropeCount(t->left);
+        if (at < lc) {
+            t = t->left;
+        } else if (at >= lc + t->n) {
+            at -= lc + t->n;
+            *start += lc + t->n;
+            t = t->right;
+        } else {
+            *start += lc;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Screen lines of the rows before row `at`.
+int ropeLinesBefore(int at) {
+    ropeNode *t = E.buf->rope;
+    int lines = 0;
+    while (t) {
+        int lc = ropeCount(t->left);
+        if (at < lc) {
+            t = t->left;
+        } else if (at >= lc + t->n) {
+            at -= lc + t->n;
+            lines += ropeLines(t->left) + t->vn;
+            t = t->right;
+        } else {
+            return lines + ropeLines(t->left) + ropeBlockLines(t, 0, at - lc);
+        }
+    }
+    return lines;
+}
+
+// The row that screen line `line` of the whole text belongs to, and in
+// *sub which of the row's lines it is.
+int ropeRowAtLine(int line, int *sub) {
+    ropeNode *t = E.buf->rope;
+    int at = 0;
+    *sub = 0;
+    while (t) {
+        int lc = ropeLines(t->left);
+        if (line < lc) {
+            t = t->left;
+        } else if (line >= lc + t->vn) {
+            line -= lc + t->vn;
+            at += ropeCount(t->left) + t->n;
+            t = t->right;
+        } else {
+            line -= lc;
+            at += ropeCount(t->left);
+            if (t->rows == NULL) return at + line;
+            int j = 0;
+            while (line >= t->rows[j].wrap) line -= t->rows[j++].wrap;
+            *sub = line;
+            return at + j;
+        }
+    }
+    return at;
+}
+
+// Row `at` now takes d more screen lines.
+void ropeAddLines(int at, int d) {
+    ropeNode *t = E.buf->rope;
+    while (t) {
+        int lc = ropeCount(t->left);
+        t->vcount += d;
+        if (at < lc) {
+            t = t->left;
+        } else if (at >= lc + t->n) {
+            at -= lc + t->n;
+            t = t->right;
+        } else {
+            t->vn += d;
+            t->rows[at - lc].wrap += d;
+            return;
+        }
+    }
+}
+
+ropeNode *ropeFind(int at, int *start) {
+    ropeNode *t = E.buf->rope_hit;
+    if (t && at >= E.buf->rope_hit_start && at < E.buf->rope_hit_start + t->n) {
+        *start = E.buf->rope_hit_start;
+        return t;
+    }
+
+    t = ropeLocate(E.buf->rope, at, start);
+    if (t) {
+        E.buf->rope_hit = t;
+        E.buf->rope_hit_start = *start;
+    }
+    return t;
+}
+
+erow *editorRowAt(int at) {
+    if (at < 0 || at >= E.buf->numrows) return NULL;
+
+    int start;
+    ropeNode *t = ropeFind(at, &start);
+    if (t->rows == NULL) {
+        pthread_rwlock_wrlock(&E.buf->rope_lock);
+        E.buf->rope = ropeMaterialize(E.buf->rope, at);
+        pthread_rwlock_unlock(&E.buf->rope_lock);
+        E.buf->rope_hit = NULL;
+        t = ropeFind(at, &start);
+    }
+    return &t->rows[at - start];
+}
+
+// Walks rows in order without materializing spans, for whole-file passes.
+// row is the erow just returned, or NULL for a line of a span.
+typedef struct rowIter {
+    int at;
+    int start;
+    ropeNode *t;
+    size_t pos;
+    erow *row;
+} rowIter;
+
+void rowIterInit(rowIter *it, int at) {
+    it->at = at;
+    it->t = NULL;
+}
+
+int rowIterNext(rowIter *it, const char **s, int *len) {
+    if (it->at >= E.buf->numrows) return 0;
+    if (it->t == NULL || it->at >= it->start + it->t->n) {
+        it->t = ropeFind(it->at, &it->start);
+        if (it->t->rows == NULL)
+            it->pos = mapLineOffset(&E.buf->map, it->t->first + it->at - it->start);
+    }
+    if (it->t->rows) {
+        erow *row = &it->t->rows[it->at - it->start];
+        *s = row->chars;
+        *len = row->size;
+        it->row = row;
+    } else {
+        it->row = NULL;
+        *s = &E.buf->map.data[it->pos];
+        *len = mapLineLength(&E.buf->map, it->pos, &it->pos);
+    }
+    it->at++;
+    return 1;
+}
+
+/*** utf-8 ***/
+
+// Character widths follow Unicode 14: combining marks and format
+// characters take no column of their own, East Asian wide and fullwidth
+// characters and most emoji take two, everything else one. Unassigned
+// code points fall inside whichever range is around them.
+
+struct unicodeRange {
+    int lo, hi;
+};
+
+struct unicodeRange unicodeZeroWidth[] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+    {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0600, 0x0605},
+    {0x0610, 0x061a}, {0x061c, 0x061c}, {0x064b, 0x065f}, {0x0670, 0x0670},
+    {0x06d6, 0x06dd}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed},
+    {0x070f, 0x070f}, {0x0711, 0x0711}, {0x0730, 0x074a}, {0x07a6, 0x07b0},
+    {0x07eb, 0x07f3}, {0x07fd, 0x07fd}, {0x0816, 0x0819}, {0x081b, 0x0823},
+    {0x0825, 0x0827}, {0x0829, 0x082d}, {0x0859, 0x085b}, {0x0890, 0x089f},
+    {0x08ca, 0x0902}, {0x093a, 0x093a}, {0x093c, 0x093c}, {0x0941, 0x0948},
+    {0x094d, 0x094d}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0981, 0x0981},
+    {0x09bc, 0x09bc}, {0x09c1, 0x09c4}, {0x09cd, 0x09cd}, {0x09e2, 0x09e3},
+    {0x09fe, 0x0a02}, {0x0a3c, 0x0a3c}, {0x0a41, 0x0a51}, {0x0a70, 0x0a71},
+    {0x0a75, 0x0a75}, {0x0a81, 0x0a82}, {0x0abc, 0x0abc}, {0x0ac1, 0x0ac8},
+    {0x0acd, 0x0acd}, {0x0ae2, 0x0ae3}, {0x0afa, 0x0b01}, {0x0b3c, 0x0b3c},
+    {0x0b3f, 0x0b3f}, {0x0b41, 0x0b44}, {0x0b4d, 0x0b56}, {0x0b62, 0x0b63},
+    {0x0b82, 0x0b82}, {0x0bc0, 0x0bc0}, {0x0bcd, 0x0bcd}, {0x0c00, 0x0c00},
+    {0x0c04, 0x0c04}, {0x0c3c, 0x0c3c}, {0x0c3e, 0x0c40}, {0x0c46, 0x0c56},
+    {0x0c62, 0x0c63}, {0x0c81, 0x0c81}, {0x0cbc, 0x0cbc}, {0x0cbf, 0x0cbf},
+    {0x0cc6, 0x0cc6}, {0x0ccc, 0x0ccd}, {0x0ce2, 0x0ce3}, {0x0d00, 0x0d01},
+    {0x0d3b, 0x0d3c}, {0x0d41, 0x0d44}, {0x0d4d, 0x0d4d}, {0x0d62, 0x0d63},
+    {0x0d81, 0x0d81}, {0x0dca, 0x0dca}, {0x0dd2, 0x0dd6}, {0x0e31, 0x0e31},
+    {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x0eb1, 0x0eb1}, {0x0eb4, 0x0ebc},
+    {0x0ec8, 0x0ecd}, {0x0f18, 0x0f19}, {0x0f35, 0x0f35}, {0x0f37, 0x0f37},
+    {0x0f39, 0x0f39}, {0x0f71, 0x0f7e}, {0x0f80, 0x0f84}, {0x0f86, 0x0f87},
+    {0x0f8d, 0x0fbc}, {0x0fc6, 0x0fc6}, {0x102d, 0x1030}, {0x1032, 0x1037},
+    {0x1039, 0x103a}, {0x103d, 0x103e}, {0x1058, 0x1059}, {0x105e, 0x1060},
+    {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108d, 0x108d},
+    {0x109d, 0x109d}, {0x1160, 0x11ff}, {0x135d, 0x135f}, {0x1712, 0x1714},
+    {0x1732, 0x1733}, {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17b4, 0x17b5},
+    {0x17b7, 0x17bd}, {0x17c6, 0x17c6}, {0x17c9, 0x17d3}, {0x17dd, 0x17dd},
+    {0x180b, 0x180f}, {0x1885, 0x1886}, {0x18a9, 0x18a9}, {0x1920, 0x1922},
+    {0x1927, 0x1928}, {0x1932, 0x1932}, {0x1939, 0x193b}, {0x1a17, 0x1a18},
+    {0x1a1b, 0x1a1b}, {0x1a56, 0x1a56}, {0x1a58, 0x1a60}, {0x1a62, 0x1a62},
+    {0x1a65, 0x1a6c}, {0x1a73, 0x1a7f}, {0x1ab0, 0x1b03}, {0x1b34, 0x1b34},
+    {0x1b36, 0x1b3a}, {0x1b3c, 0x1b3c}, {0x1b42, 0x1b42}, {0x1b6b, 0x1b73},
+    {0x1b80, 0x1b81}, {0x1ba2, 0x1ba5}, {0x1ba8, 0x1ba9}, {0x1bab, 0x1bad},
+    {0x1be6, 0x1be6}, {0x1be8, 0x1be9}, {0x1bed, 0x1bed}, {0x1bef, 0x1bf1},
+    {0x1c2c, 0x1c33}, {0x1c36, 0x1c37}, {0x1cd0, 0x1cd2}, {0x1cd4, 0x1ce0},
+    {0x1ce2, 0x1ce8}, {0x1ced, 0x1ced}, {0x1cf4, 0x1cf4}, {0x1cf8, 0x1cf9},
+    {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x206f},
+    {0x20d0, 0x20f0}, {0x2cef, 0x2cf1}, {0x2d7f, 0x2d7f}, {0x2de0, 0x2dff},
+    {0x302a, 0x302d}, {0x3099, 0x309a}, {0xa66f, 0xa672}, {0xa674, 0xa67d},
+    {0xa69e, 0xa69f}, {0xa6f0, 0xa6f1}, {0xa802, 0xa802}, {0xa806, 0xa806},
+    {0xa80b, 0xa80b}, {0xa825, 0xa826}, {0xa82c, 0xa82c}, {0xa8c4, 0xa8c5},
+    {0xa8e0, 0xa8f1}, {0xa8ff, 0xa8ff}, {0xa926, 0xa92d}, {0xa947, 0xa951},
+    {0xa980, 0xa982}, {0xa9b3, 0xa9b3}, {0xa9b6, 0xa9b9}, {0xa9bc, 0xa9bd},
+    {0xa9e5, 0xa9e5}, {0xaa29, 0xaa2e}, {0xaa31, 0xaa32}, {0xaa35, 0xaa36},
+    {0xaa43, 0xaa43}, {0xaa4c, 0xaa4c}, {0xaa7c, 0xaa7c}, {0xaab0, 0xaab0},
+    {0xaab2, 0xaab4}, {0xaab7, 0xaab8}, {0xaabe, 0xaabf}, {0xaac1, 0xaac1},
+    {0xaaec, 0xaaed}, {0xaaf6, 0xaaf6}, {0xabe5, 0xabe5}, {0xabe8, 0xabe8},
+    {0xabed, 0xabed}, {0xfb1e, 0xfb1e}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f},
+    {0xfeff, 0xfeff}, {0xfff9, 0xfffb}, {0x101fd, 0x101fd}, {0x102e0, 0x102e0},
+    {0x10376, 0x1037a}, {0x10a01, 0x10a0f}, {0x10a38, 0x10a3f}, {0x10ae5, 0x10ae6},
+    {0x10d24, 0x10d27}, {0x10eab, 0x10eac}, {0x10f46, 0x10f50}, {0x10f82, 0x10f85},
+    {0x11001, 0x11001}, {0x11038, 0x11046}, {0x11070, 0x11070}, {0x11073, 0x11074},
+    {0x1107f, 0x11081}, {0x110b3, 0x110b6}, {0x110b9, 0x110ba}, {0x110bd, 0x110bd},
+    {0x110c2, 0x110cd}, {0x11100, 0x11102}, {0x11127, 0x1112b}, {0x1112d, 0x11134},
+    {0x11173, 0x11173}, {0x11180, 0x11181}, {0x111b6, 0x111be}, {0x111c9, 0x111cc},
+    {0x111cf, 0x111cf}, {0x1122f, 0x11231}, {0x11234, 0x11234}, {0x11236, 0x11237},
+    {0x1123e, 0x1123e}, {0x112df, 0x112df}, {0x112e3, 0x112ea}, {0x11300, 0x11301},
+    {0x1133b, 0x1133c}, {0x11340, 0x11340}, {0x11366, 0x11374}, {0x11438, 0x1143f},
+    {0x11442, 0x11444}, {0x11446, 0x11446}, {0x1145e, 0x1145e}, {0x114b3, 0x114b8},
+    {0x114ba, 0x114ba}, {0x114bf, 0x114c0}, {0x114c2, 0x114c3}, {0x115b2, 0x115b5},
+    {0x115bc, 0x115bd}, {0x115bf, 0x115c0}, {0x115dc, 0x115dd}, {0x11633, 0x1163a},
+    {0x1163d, 0x1163d}, {0x1163f, 0x11640}, {0x116ab, 0x116ab}, {0x116ad, 0x116ad},
+    {0x116b0, 0x116b5}, {0x116b7, 0x116b7}, {0x1171d, 0x1171f}, {0x11722, 0x11725},
+    {0x11727, 0x1172b}, {0x1182f, 0x11837}, {0x11839, 0x1183a}, {0x1193b, 0x1193c},
+    {0x1193e, 0x1193e}, {0x11943, 0x11943}, {0x119d4, 0x119db}, {0x119e0, 0x119e0},
+    {0x11a01, 0x11a0a}, {0x11a33, 0x11a38}, {0x11a3b, 0x11a3e}, {0x11a47, 0x11a47},
+    {0x11a51, 0x11a56}, {0x11a59, 0x11a5b}, {0x11a8a, 0x11a96}, {0x11a98, 0x11a99},
+    {0x11c30, 0x11c3d}, {0x11c3f, 0x11c3f}, {0x11c92, 0x11ca7}, {0x11caa, 0x11cb0},
+    {0x11cb2, 0x11cb3}, {0x11cb5, 0x11cb6}, {0x11d31, 0x11d45}, {0x11d47, 0x11d47},
+    {0x11d90, 0x11d91}, {0x11d95, 0x11d95}, {0x11d97, 0x11d97}, {0x11ef3, 0x11ef4},
+    {0x13430, 0x13438}, {0x16af0, 0x16af4}, {0x16b30, 0x16b36}, {0x16f4f, 0x16f4f},
+    {0x16f8f, 0x16f92}, {0x16fe4, 0x16fe4}, {0x1bc9d, 0x1bc9e}, {0x1bca0, 0x1cf46},
+    {0x1d167, 0x1d169}, {0x1d173, 0x1d182}, {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad},
+    {0x1d242, 0x1d244}, {0x1da00, 0x1da36}, {0x1da3b, 0x1da6c}, {0x1da75, 0x1da75},
+    {0x1da84, 0x1da84}, {0x1da9b, 0x1daaf}, {0x1e000, 0x1e02a}, {0x1e130, 0x1e136},
+    {0x1e2ae, 0x1e2ae}, {0x1e2ec, 0x1e2ef}, {0x1e8d0, 0x1e8d6}, {0x1e944, 0x1e94a},
+    {0xe0001, 0xe01ef},
+};
+
+struct unicodeRange unicodeWide[] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+    {0x23f0, 0x23f0}, {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267f, 0x267f}, {0x2693, 0x2693}, {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26ce, 0x26ce},
+    {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b},
+    {0x2728, 0x2728}, {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27b0, 0x27b0}, {0x27bf, 0x27bf},
+    {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55}, {0x2e80, 0x3029},
+    {0x302e, 0x303e}, {0x3041, 0x3096}, {0x309b, 0x3247}, {0x3250, 0x4dbf},
+    {0x4e00, 0xa4c6}, {0xa960, 0xa97c}, {0xac00, 0xd7a3}, {0xf900, 0xfad9},
+    {0xfe10, 0xfe19}, {0xfe30, 0xfe6b}, {0xff01, 0xff60}, {0xffe0, 0xffe6},
+    {0x16fe0, 0x16fe3}, {0x16ff0, 0x1b2fb}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf},
+    {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f320}, {0x1f32d, 0x1f335},
+    {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca}, {0x1f3cf, 0x1f3d3},
+    {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e}, {0x1f440, 0x1f440},
+    {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567},
+    {0x1f57a, 0x1f57a}, {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4}, {0x1f5fb, 0x1f64f},
+    {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2}, {0x1f6d5, 0x1f6df},
+    {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7f0}, {0x1f90c, 0x1f93a},
+    {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faf6}, {0x20000, 0x3134a},
+};
+
+int unicodeInRange(int cp, struct unicodeRange *r, int n) {
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < r[mid].lo) hi = mid - 1;
+        else if (cp > r[mid].hi) lo = mid + 1;
+        else return 1;
+    }
+    return 0;
+}
+
+int unicodeWidth(int cp) {
+    if (cp < 0x300) return 1;
+    if (unicodeInRange(cp, unicodeZeroWidth, sizeof(unicodeZeroWidth) / sizeof(unicodeZeroWidth[0])))
+        return 0;
+    if (unicodeInRange(cp, unicodeWide, sizeof(unicodeWide) / sizeof(unicodeWide[0])))
+        return 2;
+    return 1;
+}
+
+// Decode the UTF-8 sequence at s, which has len bytes left. Returns its
+// length with the code point in *cp, or 1 with *cp = -1 when s does not
+// start a valid sequence.
+int utf8Decode(const char *s, int len, int *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    int n, min = 0, c = 0;
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    }
+    if (u[0] >= 0xc2 && u[0] <= 0xdf) { n = 2; min = 0x80; c = u[0] & 0x1f; }
+    else if (u[0] >= 0xe0 && u[0] <= 0xef) { n = 3; min = 0x800; c = u[0] & 0x0f; }
+    else if (u[0] >= 0xf0 && u[0] <= 0xf4) { n = 4; min = 0x10000; c = u[0] & 0x07; }
+    else n = 0;
+
+    int j;
+    for (j = 1; j < n; j++) {
+        if (j >= len || (u[j] & 0xc0) != 0x80) break;
+        c = (c << 6) | (u[j] & 0x3f);
+    }
+    if (n == 0 || j < n || c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+        *cp = -1;
+        return 1;
+    }
+    *cp = c;
+    return n;
+}
+
+// Length of the character at s: a code point with the zero width ones
+// that follow it, which the terminal draws in the same cells. *width gets
+// the columns it takes, 0 when it starts with a zero width code point.
+// A tab or a byte that is not valid UTF-8 is a character of its own.
+int utf8Char(const char *s, int len, int *width) {
+    int cp;
+    int n = utf8Decode(s, len, &cp);
+    if (cp < 0x80) {
+        *width = 1;
+        if (cp == '\t' || cp == -1) return 1;
+        // Nothing attaches to ASCII but combining marks, which never
+        // start with a byte below 0xcc.
+        if (n == len || (unsigned char)s[n] < 0xcc) return 1;
+    } else {
+        *width = unicodeWidth(cp);
+    }
+    while (n < len && (unsigned char)s[n] >= 0xcc) {
+        int m = utf8Decode(&s[n], len - n, &cp);
+        if (cp == -1 || unicodeWidth(cp) != 0) break;
+        n += m;
+    }
+    return n;
+}
+
+/*** syntax highlighting ***/
+
+// Rows are lexed on their own, starting from the state the row above
+// ended in. Only rows on screen get a class for every column; the rows
+// above them are lexed just far enough to know the state they end in.
+
+unsigned int hlHash(const char *s, int len) {
+    unsigned int h = 2166136261u;
+    int j;
+    for (j = 0; j < len; j++) {
+        h ^= (unsigned char)s[j];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int hlKeywordType(const char *s, int len) {
+    if (len > E.buf->hl.kwmax) return HL_NORMAL;
+    unsigned int k = hlHash(s, len) & E.buf->hl.kwmask;
+    while (E.buf->hl.kw[k].word) {
+        if (E.buf->hl.kw[k].len == len && memcmp(E.buf->hl.kw[k].word, s, len) == 0)
+            return E.buf->hl.kw[k].type;
+        k = (k + 1) & E.buf->hl.kwmask;
+    }
+    return HL_NORMAL;
+}
+
+void hlBuildTables(struct editorSyntax *syn) {
+    struct highlighter *h = &E.buf->hl;
+    int c;
+    for (c = 0; c < 256; c++) {
+        // isspace() and friends come from <ctype.h>.
+        if (c == '\0' || isspace(c)) h->cls[c] = HC_SPACE;
+        else if (isdigit(c)) h->cls[c] = (syn->flags & HL_HIGHLIGHT_NUMBERS) ? HC_DIGIT : HC_WORD;
+        else if (isalpha(c) || c == '_' || c >= 0x80) h->cls[c] = HC_WORD;
+        else h->cls[c] = HC_SEP;
+    }
+    if (syn->flags & HL_HIGHLIGHT_STRINGS) h->cls['"'] = h->cls['\''] = HC_QUOTE;
+
+    int n = 0;
+    while (syn->keywords[n]) n++;
+    unsigned int size = 16;
+    while (size < (unsigned int)n * 2) size *= 2;
+    free(h->kw);
+    h->kw = calloc(size, sizeof(hlKeyword));
+    if (h->kw == NULL) die("calloc");
+    h->kwmask = size - 1;
+    h->kwmax = 0;
+    int j;
+    for (j = 0; j < n; j++) {
+        const char *w = syn->keywords[j];
+        int len = strlen(w);
+        int type = HL_KEYWORD1;
+        if (len > 0 && w[len - 1] == '|') {
+            len--;
+            type = HL_KEYWORD2;
+        }
+        // A keyword such as #include makes its first byte part of words.
+        if (len > 0 && h->cls[(unsigned char)w[0]] == HC_SEP) h->cls[(unsigned char)w[0]] = HC_WORD;
+        unsigned int k = hlHash(w, len) & h->kwmask;
+        while (h->kw[k].word) k = (k + 1) & h->kwmask;
+        h->kw[k].word = w;
+        h->kw[k].len = len;
+        h->kw[k].type = type;
+        if (len > h->kwmax) h->kwmax = len;
+    }
+
+    h->sclen = syn->singleline_comment_start ? strlen(syn->singleline_comment_start) : 0;
+    h->mslen = syn->multiline_comment_start ? strlen(syn->multiline_comment_start) : 0;
+    h->melen = syn->multiline_comment_end ? strlen(syn->multiline_comment_end) : 0;
+    if (h->mslen == 0 || h->melen == 0) h->mslen = h->melen = 0;
+    if (h->sclen) h->cls[(unsigned char)syn->singleline_comment_start[0]] |= HC_COMMENT;
+    if (h->mslen) h->cls[(unsigned char)syn->multiline_comment_start[0]] |= HC_COMMENT;
+}
+
+void editorSelectSyntaxHighlight() {
+    E.buf->syntax = NULL;
+    if (E.buf->filename == NULL) return;
+
+    char *ext = strrchr(E.buf->filename, '.');
+    unsigned int j;
+    for (j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = &HLDB[j];
+        int i;
+        for (i = 0; s->filematch[i]; i++) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.buf->filename, s->filematch[i]))) {
+                E.buf->syntax = s;
+                hlBuildTables(s);
+                return;
+            }
+        }
+    }
+}
+
+void hlPaint(unsigned char *hl, int from, int to, int type) {
+    if (hl) memset(&hl[from], type, to - from);
+}
+
+// Where the delimiter d ends when it occurs in s[from .. len - 1], or -1.
+int hlFindEnd(const char *s, int from, int len, const char *d, int dlen) {
+    while (from + dlen <= len) {
+        const char *p = memchr(&s[from], d[0], len - dlen + 1 - from);
+        if (p == NULL) break;
+        from = p - s;
+        if (memcmp(p, d, dlen) == 0) return from + dlen;
+        from++;
+    }
+    return -1;
+}
+
+// Lex len bytes of a row that starts in `state` and return the state it
+// ends in. With hl, also store the class of every byte there.
+int hlLexRow(const char *s, int len, int state, unsigned char *hl) {
+    struct highlighter *h = &E.buf->hl;
+    struct editorSyntax *syn = E.buf->syntax;
+    int i = 0;
+
+    if (hl) memset(hl, HL_NORMAL, len);
+    if (state == HLS_COMMENT) {
+        i = hlFindEnd(s, 0, len, syn->multiline_comment_end, h->melen);
+        if (i == -1) {
+            hlPaint(hl, 0, len, HL_MLCOMMENT);
+            return HLS_COMMENT;
+        }
+        hlPaint(hl, 0, i, HL_MLCOMMENT);
+    }
+
+    while (i < len) {
+        unsigned char c = s[i];
+        int cls = h->cls[c];
+        int j = i + 1;
+
+        if (cls & HC_COMMENT) {
+            if (h->sclen && len - i >= h->sclen &&
+                memcmp(&s[i], syn->singleline_comment_start, h->sclen) == 0) {
+                hlPaint(hl, i, len, HL_COMMENT);
+                return HLS_NORMAL;
+            }
+            if (h->mslen && len - i >= h->mslen &&
+                memcmp(&s[i], syn->multiline_comment_start, h->mslen) == 0) {
+                j = hlFindEnd(s, i + h->mslen, len, syn->multiline_comment_end, h->melen);
+                if (j == -1) {
+                    hlPaint(hl, i, len, HL_MLCOMMENT);
+                    return HLS_COMMENT;
+                }
+                hlPaint(hl, i, j, HL_MLCOMMENT);
+                i = j;
+                continue;
+            }
+            cls &= ~HC_COMMENT;
+        }
+
+        switch (cls) {
+        case HC_QUOTE:
+            while (j < len && s[j] != c) {
+                if (s[j] == '\\' && j + 1 < len) j++;
+                j++;
+            }
+            if (j < len) j++;
+            hlPaint(hl, i, j, HL_STRING);
+            break;
+        case HC_DIGIT:
+            // Hex digits, suffixes and exponents run on as part of it.
+            while (j < len && (s[j] == '.' || (h->cls[(unsigned char)s[j]] & ~HC_COMMENT) == HC_WORD ||
+                               (h->cls[(unsigned char)s[j]] & ~HC_COMMENT) == HC_DIGIT))
+                j++;
+            hlPaint(hl, i, j, HL_NUMBER);
+            break;
+        case HC_WORD:
+            while (j < len && ((h->cls[(unsigned char)s[j]] & ~HC_COMMENT) == HC_WORD ||
+                               (h->cls[(unsigned char)s[j]] & ~HC_COMMENT) == HC_DIGIT))
+                j++;
+            hlPaint(hl, i, j, hlKeywordType(&s[i], j - i));
+            break;
+        }
+        i = j;
+    }
+    return HLS_NORMAL;
+}
+
+// The state row `at` ends in. Rows that do not know theirs are lexed from
+// the nearest row above that does, but from no more than KILO_HL_SYNC rows
+// up, and keep what they learn; lines of the file mapping that were never
+// read have nowhere to keep it.
+int editorRowState(int at) {
+    if (E.buf->syntax == NULL || at < 0) return HLS_NORMAL;
+
+    int from = at;
+    int limit = at - KILO_HL_SYNC;
+    int state = HLS_NORMAL;
+    while (from >= 0 && from > limit) {
+        int start;
+        ropeNode *t = ropeFind(from, &start);
+        if (t->rows == NULL) {
+            from = start - 1;
+            continue;
+        }
+        if (t->rows[from - start].hl_state != HLS_UNKNOWN) {
+            state = t->rows[from - start].hl_state;
+            break;
+        }
+        from--;
+    }
+    if (from < limit) from = limit;
+    if (from == at) return state;
+
+    rowIter it;
+    const char *s;
+    int len;
+    rowIterInit(&it, from + 1);
+    while (it.at <= at && rowIterNext(&it, &s, &len)) {
+        state = hlLexRow(s, len, state, NULL);
+        if (it.row) it.row->hl_state = state;
+    }
+    return state;
+}
+
+// Bring the states of the rows edited since the last frame up to date,
+// and those of the rows after them for as long as they come out different
+// from before. The rows themselves are lexed again when they are drawn.
+void editorHighlightSettle() {
+    int lo = E.buf->hl.lo, hi = E.buf->hl.hi;
+    E.buf->hl.lo = -1;
+    if (lo == -1 || E.buf->syntax == NULL) return;
+
+    int state = editorRowState(lo - 1);
+    // A row's state may have been worked out through rows that keep none,
+    // but through no more than KILO_HL_SYNC of them; gap counts those.
+    int gap = 0;
+    rowIter it;
+    const char *s;
+    int len;
+    rowIterInit(&it, lo);
+    while (rowIterNext(&it, &s, &len)) {
+        int at = it.at - 1;
+        if (at >= hi && gap >= KILO_HL_SYNC) break;
+        if (it.row == NULL) {
+            int end = it.start + it.t->n;
+            if (end - at > KILO_HL_SYNC) {
+                if (at >= hi) break;
+                rowIterInit(&it, end - KILO_HL_SYNC);
+                state = HLS_NORMAL;
+                gap = 0;
+                continue;
+            }
+            state = hlLexRow(s, len, state, NULL);
+            gap++;
+            continue;
+        }
+        int next = hlLexRow(s, len, state, NULL);
+        if (it.row->hl_state == HLS_UNKNOWN) {
+            gap++;
+        } else {
+            if (at >= hi && next == it.row->hl_state) break;
+            gap = 0;
+        }
+        it.row->hl_state = next;
+        state = next;
+    }
+}
+
+// Highlight the rendering of a row that starts in `state`, unless it
+// already is, and return the state the row ends in.
+int editorRowHighlight(erow *row, renderSlot *rs, int state) {
+    if (rs->hl_in != state) {
+        rs->hl_out = hlLexRow(rs->render, rs->len, state, rs->hl);
+        rs->hl_in = state;
+    }
+    row->hl_state = rs->hl_out;
+    return rs->hl_out;
+}
+
+// The foreground color of every highlight class, as a 16-color code and
+// as 24-bit RGB. The RGB colors are all in the 6x6x6 cube of 256-color
+// terminals, so terminals with 24-bit color get the shorter 256-color
+// code for them too; a color off the cube would be sent as RGB there.
+struct hlColor {
+    int basic;
+    unsigned char r, g, b;
+} hlPalette[] = {
+    [HL_NORMAL] = { 39, 0, 0, 0 },
+    [HL_COMMENT] = { 36, 95, 135, 95 },
+    [HL_MLCOMMENT] = { 36, 95, 135, 95 },
+    [HL_KEYWORD1] = { 33, 175, 135, 215 },
+    [HL_KEYWORD2] = { 32, 95, 215, 175 },
+    [HL_STRING] = { 35, 215, 135, 95 },
+    [HL_NUMBER] = { 31, 175, 215, 175 },
+};
+
+// The step of the color cube nearest to v, and the value of step k.
+int hlCubeStep(int v) {
+    if (v < 48) return 0;
+    if (v < 115) return 1;
+    return (v - 35) / 40;
+}
+
+int hlCubeValue(int k) {
+    return k ? 55 + 40 * k : 0;
+}
+
+// Write the SGR parameters that select the color of hl to buf.
+int editorSyntaxToColor(int hl, char *buf) {
+    struct hlColor *c = &hlPalette[hl];
+    if (hl == HL_NORMAL || E.colors == 16) return sprintf(buf, "%d", c->basic);
+    int r = hlCubeStep(c->r), g = hlCubeStep(c->g), b = hlCubeStep(c->b);
+    if (E.colors == 256 || (hlCubeValue(r) == c->r && hlCubeValue(g) == c->g && hlCubeValue(b) == c->b))
+        return sprintf(buf, "38;5;%d", 16 + 36 * r + 6 * g + b);
+    return sprintf(buf, "38;2;%d;%d;%d", c->r, c->g, c->b);
+}
+
+/*** row storage ***/
+
+// Edited rows keep their text in chunks of KILO_SLAB_MIN << class bytes,
+// cut one after another from big slabs and kept on a free list per class
+// once the row lets go of them. Rows made together sit next to each other,
+// a short line costs no malloc() of its own, and a row being typed into
+// grows in place until its chunk is full. Longer rows get their own
+// malloc() with room for half as much again.
+
+struct slabState {
+    char *free[KILO_SLAB_CLASSES];
+    char *top;
+    size_t left;
+};
+
+struct slabState slabs;
+
+// The smallest class with room for need bytes.
+int slabClass(size_t need) {
+    int c = 0;
+    while (((size_t)KILO_SLAB_MIN << c) < need) c++;
+    return c;
+}
+
+void slabFree(char *p, size_t cap) {
+    if (cap > KILO_SLAB_MAX) {
+        free(p);
+        return;
+    }
+    int c = slabClass(cap);
+    memcpy(p, &slabs.free[c], sizeof(char *));
+    slabs.free[c] = p;
+}
+
+// A chunk of at least need bytes, its size in *cap. The extra room of a
+// long row stops where the size would no longer fit an int.
+char *slabAlloc(size_t need, int *cap) {
+    char *p;
+    if (need > INT_MAX) {
+        errno = EOVERFLOW;
+        die("row too long");
+    }
+    if (need > KILO_SLAB_MAX) {
+        size_t size = need + need / 2;
+        if (size > INT_MAX) size = INT_MAX;
+        p = malloc(size);
+        if (p == NULL) die("malloc");
+        *cap = size;
+        return p;
+    }
+    int c = slabClass(need);
+    size_t size = (size_t)KILO_SLAB_MIN << c;
+    *cap = size;
+    if (slabs.free[c]) {
+        p = slabs.free[c];
+        memcpy(&slabs.free[c], p, sizeof(char *));
+        return p;
+    }
+    if (slabs.left < size) {
+        // The rest of the slab goes to the free lists in the biggest
+        // chunks it splits into.
+        while (slabs.left >= KILO_SLAB_MIN) {
+            int k = slabClass(slabs.left);
+            if (((size_t)KILO_SLAB_MIN << k) > slabs.left) k--;
+            slabFree(slabs.top, KILO_SLAB_MIN << k);
+            slabs.top += (size_t)KILO_SLAB_MIN << k;
+            slabs.left -= (size_t)KILO_SLAB_MIN << k;
+        }
+        slabs.top = malloc(KILO_SLAB_BYTES);
+        if (slabs.top == NULL) die("malloc");
+        slabs.left = KILO_SLAB_BYTES;
+    }
+    p = slabs.top;
+    slabs.top += size;
+    slabs.left -= size;
+    return p;
+}
+
+/*** row operations ***/ 
+
+// Rendered rows live in a small cache sized to the screen instead of in
+// every erow, and are only built when a row is drawn. A slot belongs to a
+// row while its tag matches the row's rtag, so a slot can be handed to
+// another row without tracking down the row that used it before.
+
+renderSlot *editorRowSlot(erow *row) {
+    if (row->rtag && row->rslot < E.buf->nrcache && E.buf->rcache[row->rslot].tag == row->rtag)
+        return &E.buf->rcache[row->rslot];
+    return NULL;
+}
+
+// Length of the character at chars[at] and, in *cols, the columns it
+// takes when it starts at column rx.
+int editorRowChar(erow *row, int at, int rx, int *cols) {
+    int n = utf8Char(&row->chars[at], row->size - at, cols);
+    if (row->chars[at] == '\t') *cols = KILO_TAB_STOP - rx % KILO_TAB_STOP;
+    else if (*cols == 0) *cols = 1;
+    return n;
+}
+
+// The last mark at or before byte cx of chars, or column rx.
+int editorMarkByCx(renderSlot *rs, int cx) {
+    int lo = 0, hi = rs->nmarks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (rs->marks[mid].cx <= cx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+int editorMarkByRx(renderSlot *rs, int rx) {
+    int lo = 0, hi = rs->nmarks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (rs->marks[mid].rx <= rx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+void renderReserve(renderSlot *rs, int need) {
+    if (need <= rs->cap) return;
+    while (rs->cap < need) rs->cap = rs->cap ? rs->cap * 2 : 64;
+    rs->render = realloc(rs->render, rs->cap);
+    rs->hl = realloc(rs->hl, rs->cap);
+    if (rs->render == NULL || rs->hl == NULL) die("realloc");
+}
+
+void renderAddMark(renderSlot *rs, int cx, int ri, int rx, int line, int col) {
+    if (rs->nmarks == rs->markcap) {
+        rs->markcap = rs->markcap ? rs->markcap * 2 : 8;
+        rs->marks = realloc(rs->marks, sizeof(renderMark) * rs->markcap);
+        if (rs->marks == NULL) die("realloc");
+    }
+    renderMark *m = &rs->marks[rs->nmarks++];
+    m->cx = cx;
+    m->ri = ri;
+    m->rx = rx;
+    m->line = line;
+    m->col = col;
+}
+
+// The screen width rows wrap at, 0 when soft wrap is off.
+int editorWrapCols() {
+    return E.win->wrap ? E.win->screencols : 0;
+}
+
+// Place a character `w` columns wide after col columns of screen line
+// *line: it starts the next line when it does not fit on this one.
+void editorWrapAdvance(int wrap, int w, int *line, int *col) {
+    if (wrap && *col > 0 && *col + w > wrap) {
+        (*line)++;
+        *col = 0;
+    }
+    *col += w;
+}
+
+// Re-render row from chars[at] on, the part before it cannot change. The
+// work starts at a mark, where a character starts, that is a whole UTF-8
+// sequence before `at`: the bytes there may now decode to a combining mark
+// that belongs to the character before.
+void editorRenderFrom(erow *row, renderSlot *rs, int at) {
+    perf.renders++;
+    int cx = 0, idx = 0, rx = 0, line = 0, col = 0;
+    int wrap = editorWrapCols();
+    if (rs->wrap != wrap) {
+        // Marks counted for another width are no use.
+        rs->wrap = wrap;
+        at = 0;
+    }
+    if (rs->nmarks > 0) {
+        renderMark *m = &rs->marks[editorMarkByCx(rs, at - 4)];
+        cx = m->cx;
+        idx = m->ri;
+        rx = m->rx;
+        line = m->line;
+        col = m->col;
+        rs->nmarks = m - rs->marks;
+    }
+
+    // Even an empty row has the mark at its start.
+    if (rs->nmarks == 0) renderAddMark(rs, 0, 0, 0, 0, 0);
+    while (cx < row->size) {
+        if (cx >= rs->nmarks * KILO_RENDER_MARK) renderAddMark(rs, cx, idx, rx, line, col);
+
+        int cols;
+        int n = utf8Char(&row->chars[cx], row->size - cx, &cols);
+        renderReserve(rs, idx + n + KILO_TAB_STOP + 4);
+        char *r = &rs->render[idx];
+        if (row->chars[cx] == '\t') {
+            cols = KILO_TAB_STOP - rx % KILO_TAB_STOP;
+            memset(r, ' ', cols);
+            idx += cols;
+            // A tab may be broken over two screen lines.
+            int k;
+            for (k = 0; k < cols; k++) editorWrapAdvance(wrap, 1, &line, &col);
+        } else if (n == 1 && (unsigned char)row->chars[cx] >= 0x80) {
+            // A byte that is not UTF-8 shows as U+FFFD.
+            memcpy(r, "\xef\xbf\xbd", 3);
+            idx += 3;
+        } else {
+            // Combining marks at the start of the row or after a tab get
+            // a space to combine with.
+            if (cols == 0) {
+                r[0] = ' ';
+                idx++;
+                cols = 1;
+            }
+            memcpy(&rs->render[idx], &row->chars[cx], n);
+            idx += n;
+        }
+        if (row->chars[cx] != '\t') editorWrapAdvance(wrap, cols, &line, &col);
+        rx += cols;
+        cx += n;
+    }
+    renderReserve(rs, idx + 1);
+    rs->render[idx] = '\0';
+    rs->len = idx;
+    rs->hl_in = HLS_UNKNOWN;
+    // The cursor after the last character needs a column too.
+    editorWrapAdvance(wrap, 1, &line, &col);
+    rs->lines = line + 1;
+}
+
+renderSlot *editorRowRender(erow *row) {
+    renderSlot *rs = editorRowSlot(row);
+    if (rs == NULL) {
+        // Enough for all windows on the buffer: they share the screen.
+        int want = E.termrows * 2 + 4;
+        if (E.buf->nrcache < want) {
+            E.buf->rcache = realloc(E.buf->rcache, sizeof(renderSlot) * want);
+            if (E.buf->rcache == NULL) die("realloc");
+            memset(&E.buf->rcache[E.buf->nrcache], 0, sizeof(renderSlot) * (want - E.buf->nrcache));
+            E.buf->nrcache = want;
+        }
+
+        // Take a free slot, or else the one drawn least recently.
+        int j, victim = 0;
+        for (j = 0; j < E.buf->nrcache; j++) {
+            if (E.buf->rcache[j].tag == 0) {
+                victim = j;
+                break;
+            }
+            if (E.buf->rcache[j].used < E.buf->rcache[victim].used) victim = j;
+        }
+
+        rs = &E.buf->rcache[victim];
+        if (++E.buf->rtag == 0) E.buf->rtag = 1;
+        rs->tag = E.buf->rtag;
+        row->rslot = victim;
+        row->rtag = rs->tag;
+        editorRenderFrom(row, rs, 0);
+    } else if (rs->wrap != editorWrapCols()) {
+        editorRenderFrom(row, rs, 0);
+    }
+    rs->used = E.frame;
+    return rs;
+}
+
+// Column and byte offsets are converted from the nearest mark of the
+// row's rendering, so long lines are not walked from their start.
+
+int editorRowCxToRx(erow *row, int cx) {
+    renderSlot *rs = editorRowRender(row);
+    renderMark *m = &rs->marks[editorMarkByCx(rs, cx)];
+    int rx = m->rx;
+    int j = m->cx;
+    while (j < cx) {
+        int cols;
+        int n = editorRowChar(row, j, rx, &cols);
+        // cx inside a character is where the character is.
+        if (j + n > cx) break;
+        rx += cols;
+        j += n;
+    }
+    return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+    renderSlot *rs = editorRowRender(row);
+    renderMark *m = &rs->marks[editorMarkByRx(rs, rx)];
+    int cur_rx = m->rx;
+    int cx = m->cx;
+    while (cx < row->size) {
+        int cols;
+        int n = editorRowChar(row, cx, cur_rx, &cols);
+        cur_rx += cols;
+
+        if (cur_rx > rx) return cx;
+        cx += n;
+    }
+    return cx;
+}
+
+// Where the character before byte cx of the row starts.
+int editorRowPrevCx(erow *row, int cx) {
+    renderSlot *rs = editorRowRender(row);
+    int j = rs->marks[editorMarkByCx(rs, cx - 1)].cx;
+    int prev = j;
+    while (j < cx) {
+        int cols;
+        prev = j;
+        j += utf8Char(&row->chars[j], row->size - j, &cols);
+    }
+    return prev;
+}
+
+// Where the character after the one at byte cx of the row starts.
+int editorRowNextCx(erow *row, int cx) {
+    int cols;
+    return cx + utf8Char(&row->chars[cx], row->size - cx, &cols);
+}
+
+// The offset in the rendering of the first character that starts at or
+// right of column rx, and in *col the column it starts at.
+int editorRenderOffset(renderSlot *rs, int rx, int *col) {
+    renderMark *m = &rs->marks[editorMarkByRx(rs, rx)];
+    int ri = m->ri;
+    int c = m->rx;
+    while (c < rx && ri < rs->len) {
+        int cols;
+        ri += utf8Char(&rs->render[ri], rs->len - ri, &cols);
+        c += cols;
+    }
+    *col = c;
+    return ri;
+}
+
+// With soft wrap, the screen line and column of the character at render
+// column rx, or of the cursor after the last character.
+void editorWrapPos(renderSlot *rs, int rx, int *line, int *col) {
+    renderMark *m = &rs->marks[editorMarkByRx(rs, rx)];
+    int ri = m->ri;
+    int c = m->rx;
+    *line = m->line;
+    *col = m->col;
+    int w = 1;
+    while (ri < rs->len) {
+        ri += utf8Char(&rs->render[ri], rs->len - ri, &w);
+        if (c >= rx) break;
+        editorWrapAdvance(rs->wrap, w, line, col);
+        c += w;
+        w = 1;
+    }
+    // Where the character itself goes.
+    editorWrapAdvance(rs->wrap, w, line, col);
+    *col -= w;
+}
+
+// The last mark before screen line `line`.
+int editorMarkByLine(renderSlot *rs, int line) {
+    int lo = 0, hi = rs->nmarks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (rs->marks[mid].line < line) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// The offset in the rendering where screen line `line` of the row starts,
+// and in *rx its render column. Past the last line this is the end.
+int editorWrapLineStart(renderSlot *rs, int line, int *rx) {
+    renderMark *m = &rs->marks[editorMarkByLine(rs, line)];
+    int ri = m->ri;
+    int l = m->line;
+    int c = m->col;
+    *rx = m->rx;
+    if (line <= 0) return 0;
+    while (ri < rs->len) {
+        int w;
+        int n = utf8Char(&rs->render[ri], rs->len - ri, &w);
+        editorWrapAdvance(rs->wrap, w, &l, &c);
+        if (l == line) break;
+        ri += n;
+        *rx += w;
+    }
+    return ri;
+}
+
+// The render column of the character shown at column col of screen line
+// `line`. Right of the line's last character that is the last character,
+// unless the line is the row's last, where the cursor may go after it.
+int editorWrapRx(renderSlot *rs, int line, int col) {
+    int rx;
+    int ri = editorWrapLineStart(rs, line, &rx);
+    int c = 0, last = rx;
+    while (ri < rs->len) {
+        int w;
+        int n = utf8Char(&rs->render[ri], rs->len - ri, &w);
+        if (c > 0 && c + w > rs->wrap) return last;
+        if (c + w > col) return rx;
+        last = rx;
+        c += w;
+        rx += w;
+        ri += n;
+    }
+    if (c > 0 && c + 1 > rs->wrap) return last;
+    return rx;
+}
+
+// Screen lines row `at` takes with soft wrap. The count in the row buffer
+// is brought up to date, it is not while the row was edited or the screen
+// resized since it was last measured.
+int editorRowLines(int at) {
+    erow *row = editorRowAt(at);
+    int lines = editorRowRender(row)->lines;
+    if (lines != row->wrap) ropeAddLines(at, lines - row->wrap);
+    return lines;
+}
+
+// chars changed from `at` on: bring a cached rendering up to date, rows
+// that have none are rendered when they are next drawn. The row is lexed
+// again from its start, see editorHighlightSettle().
+void editorUpdateRow(erow *row, int at) {
+    row->hl_state = HLS_UNKNOWN;
+    renderSlot *rs = editorRowSlot(row);
+    if (rs) editorRenderFrom(row, rs, at);
+}
+
+// Record that rows at .. at + removed - 1 were replaced by `added` rows,
+// so a save knows which part of the file it has to write, the highlighter
+// which rows to lex again, and grep views which rows to test again.
+void editorMarkDirty(int at, int removed, int added) {
+    if (E.buf->save_lo == -1) {
+        E.buf->save_lo = at;
+        E.buf->save_hi = at;
+        E.buf->save_tail = at;
+    }
+    if (at < E.buf->save_lo) E.buf->save_lo = at;
+    if (at + removed > E.buf->save_hi) {
+        E.buf->save_tail += at + removed - E.buf->save_hi;
+        E.buf->save_hi = at + removed;
+    }
+    E.buf->save_hi += added - removed;
+
+    if (E.buf->hl.lo == -1) {
+        E.buf->hl.lo = at;
+        E.buf->hl.hi = at;
+    }
+    if (at < E.buf->hl.lo) E.buf->hl.lo = at;
+    if (at + removed > E.buf->hl.hi) E.buf->hl.hi = at + removed;
+    E.buf->hl.hi += added - removed;
+
+    filterEdit(at, removed, added);
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.buf->numrows) return;
+
+    erow row;
+    row.size = len;
+    row.mapped = 0;
+    row.hl_state = HLS_UNKNOWN;
+    row.chars = slabAlloc(len + 1, &row.cap);
+    memcpy(row.chars, s, len);
+    row.chars[len] = '\0';
+    row.rtag = 0;
+    row.wrap = 1;
+
+    E.buf->rope = ropeInsertRow(E.buf->rope, at, &row);
+    E.buf->rope_hit = NULL;
+    E.buf->numrows++;
+    E.buf->dirty++;
+    editorMarkDirty(at, 0, 1);
+}
+
+void editorFreeRow(erow *row) {
+    renderSlot *rs = editorRowSlot(row);
+    if (rs) rs->tag = 0;
+    if (!row->mapped) slabFree(row->chars, row->cap);
+}
+
+// Make room for len bytes of text and the '\0' after them, giving a row
+// still backed by the file mapping its own copy of the text. The first
+// len bytes the row has are kept.
+void editorRowReserve(erow *row, size_t len) {
+    if (!row->mapped && len < (size_t)row->cap) return;
+    int cap;
+    char *chars = slabAlloc(len + 1, &cap);
+    size_t keep = (size_t)row->size < len ? (size_t)row->size : len;
+    memcpy(chars, row->chars, keep);
+    chars[keep] = '\0';
+    if (!row->mapped) slabFree(row->chars, row->cap);
+    row->chars = chars;
+    row->cap = cap;
+    row->mapped = 0;
+}
+
+void editorRowOwn(erow *row) {
+    if (row->mapped) editorRowReserve(row, row->size);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.buf->numrows) return;
+    editorFreeRow(editorRowAt(at));
+    E.buf->rope = ropeDeleteRow(E.buf->rope, at);
+    E.buf->rope_hit = NULL;
+    E.buf->numrows--;
+    E.buf->dirty++;
+    editorMarkDirty(at, 1, 0);
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    // memmove() comes from <string.h>
+    if (at < 0 || at > row->size) at = row->size;
+    editorRowReserve(row, row->size + 1);
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    editorUpdateRow(row, at);
+    E.buf->dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+    if (at < 0 || at > row->size) at = row->size;
+    editorRowReserve(row, row->size + len);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    editorUpdateRow(row, at);
+    E.buf->dirty++;
+}
+
+void editorInsertNewLine() {
+    if (E.win->cy == E.buf->numrows) undoAdd(UNDO_ROW, 0, E.win->cy, 0, E.win->cy, 0, NULL, 0);
+    else undoAdd(UNDO_INSERT, 0, E.win->cy, E.win->cx, E.win->cy + 1, 0, "\n", 1);
+    if (E.win->cx == 0) {
+        editorInsertRow(E.win->cy, "", 0);
+    } else {
+        erow *row = editorRowAt(E.win->cy);
+        editorInsertRow(E.win->cy + 1, &row->chars[E.win->cx], row->size - E.win->cx);
+        row = editorRowAt(E.win->cy);
+        editorRowOwn(row);
+        row->size = E.win->cx;
+        row->chars[row->size] = '\0';
+        editorUpdateRow(row, row->size);
+        editorMarkDirty(E.win->cy, 1, 1);
+    }
+    E.win->cy++;
+    E.win->cx = 0;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowReserve(row, row->size + len);
+    int at = row->size;
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row, at);
+    E.buf->dirty++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+    if (at < 0 || at >= row->size) return;
+    editorRowOwn(row);
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    editorUpdateRow(row, at);
+    E.buf->dirty++;
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    int flags = 0;
+    if (E.win->cy == E.buf->numrows) {
+        editorInsertRow(E.buf->numrows, "", 0);
+        undoAdd(UNDO_ROW, 0, E.win->cy, 0, E.win->cy, 0, NULL, 0);
+        flags = UNDO_CHAIN;
+    }
+    editorRowInsertChar(editorRowAt(E.win->cy), E.win->cx, c);
+    editorMarkDirty(E.win->cy, 1, 1);
+    if (flags) {
+        char ch = c;
+        undoAdd(UNDO_INSERT, flags | UNDO_TYPED, E.win->cy, E.win->cx, E.win->cy, E.win->cx + 1, &ch, 1);
+    } else {
+        char ch = c;
+        undoTyped(UNDO_INSERT, E.win->cy, E.win->cx, &ch, 1);
+    }
+    E.win->cx++;
+}
+
+// Length of the line at s, which ends at \n, \r or \r\n; terminals send
+// pasted line breaks as \r. *next gets the offset of the following line,
+// which equals the length when the text has no line break.
+size_t textLineLength(const char *s, size_t len, size_t *next) {
+    size_t j = 0;
+    while (j < len && s[j] != '\n' && s[j] != '\r') j++;
+    *next = j;
+    if (j < len) *next += (s[j] == '\r' && j + 1 < len && s[j + 1] == '\n') ? 2 : 1;
+    return j;
+}
+
+// Insert a block of text at the cursor. The new rows are packed into full
+// blocks and joined to the row buffer in one split and merge, instead of
+// going through the key handlers one character at a time.
+void editorInsertText(const char *s, size_t len) {
+    if (len == 0) return;
+    int flags = 0;
+    if (E.win->cy == E.buf->numrows) {
+        editorInsertRow(E.buf->numrows, "", 0);
+        undoAdd(UNDO_ROW, 0, E.win->cy, 0, E.win->cy, 0, NULL, 0);
+        flags = UNDO_CHAIN;
+    }
+    erow *row = editorRowAt(E.win->cy);
+    int cy = E.win->cy, cx = E.win->cx;
+
+    size_t p;
+    size_t first = textLineLength(s, len, &p);
+    if (first == len) {
+        editorRowInsertString(row, E.win->cx, s, len);
+        editorMarkDirty(E.win->cy, 1, 1);
+        E.win->cx += len;
+        undoAdd(UNDO_INSERT, flags, cy, cx, E.win->cy, E.win->cx, s, len);
+        return;
+    }
+
+    editorRowOwn(row);
+    int taillen = row->size - E.win->cx;
+    ropeNode *ins = NULL;
+    ropeNode *t = NULL;
+    int added = 0;
+    int lastlen;
+    while (1) {
+        size_t adv;
+        size_t n = textLineLength(&s[p], len - p, &adv);
+        // The last line has no break after it and takes the rest of the
+        // row the cursor was on.
+        int last = adv == n;
+
+        erow nr;
+        nr.size = n + (last ? taillen : 0);
+        nr.mapped = 0;
+        nr.hl_state = HLS_UNKNOWN;
+        nr.chars = slabAlloc(nr.size + 1, &nr.cap);
+        memcpy(nr.chars, &s[p], n);
+        if (last) memcpy(&nr.chars[n], &row->chars[E.win->cx], taillen);
+        nr.chars[nr.size] = '\0';
+        nr.rtag = 0;
+        nr.wrap = 1;
+
+        if (t == NULL || t->n == KILO_BLOCK_ROWS) {
+            if (t) {
+                ropeUpdate(t);
+                ins = ropeMerge(ins, t);
+            }
+            t = ropeNewNode();
+        }
+        t->rows[t->n++] = nr;
+        t->vn++;
+        added++;
+        p += adv;
+        if (last) {
+            lastlen = n;
+            break;
+        }
+    }
+    ropeUpdate(t);
+    ins = ropeMerge(ins, t);
+
+    editorRowReserve(row, E.win->cx + first);
+    memcpy(&row->chars[E.win->cx], s, first);
+    row->size = E.win->cx + first;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row, E.win->cx);
+
+    ropeNode *l, *r;
+    ropeSplit(E.buf->rope, E.win->cy + 1, &l, &r);
+    E.buf->rope = ropeMerge(ropeMerge(l, ins), r);
+    E.buf->rope_hit = NULL;
+    E.buf->numrows += added;
+    editorMarkDirty(E.win->cy, 1, 1 + added);
+    E.win->cy += added;
+    E.win->cx = lastlen;
+    E.buf->dirty++;
+    undoAdd(UNDO_INSERT, flags, cy, cx, E.win->cy, E.win->cx, s, len);
+}
+
+void editorDelChar() {
+    if (E.win->cy == E.buf->numrows) return;
+    if (E.win->cx == 0 && E.win->cy == 0) return;
+
+    erow *row = editorRowAt(E.win->cy);
+    if (E.win->cx > 0) {
+        // The whole character goes.
+        int start = editorRowPrevCx(row, E.win->cx);
+        undoTyped(UNDO_DELETE, E.win->cy, start, &row->chars[start], E.win->cx - start);
+        while (E.win->cx > start) {
+            editorRowDelChar(row, E.win->cx - 1);
+            E.win->cx--;
+        }
+        editorMarkDirty(E.win->cy, 1, 1);
+    } else {
+        erow *prev = editorRowAt(E.win->cy - 1);
+        undoTyped(UNDO_DELETE, E.win->cy - 1, prev->size, "\n", 1);
+        E.win->cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->size);
+        editorMarkDirty(E.win->cy - 1, 1, 1);
+        editorDelRow(E.win->cy);
+        E.win->cy--;
+    }
+}
+
+// Delete the text from row, col up to endrow, endcol, joining the rows
+// in between at once, and leave the cursor where it started.
+void editorDeleteText(int row, int col, int endrow, int endcol) {
+    if (row == endrow) {
+        erow *r = editorRowAt(row);
+        editorRowOwn(r);
+        memmove(&r->chars[col], &r->chars[endcol], r->size - endcol + 1);
+        r->size -= endcol - col;
+        editorUpdateRow(r, col);
+    } else {
+        erow *last = editorRowAt(endrow);
+        int taillen = last->size - endcol;
+        char *tail = malloc(taillen + 1);
+        if (tail == NULL) die("malloc");
+        memcpy(tail, &last->chars[endcol], taillen);
+
+        erow *r = editorRowAt(row);
+        editorRowReserve(r, col + taillen);
+        memcpy(&r->chars[col], tail, taillen);
+        r->size = col + taillen;
+        r->chars[r->size] = '\0';
+        editorUpdateRow(r, col);
+        free(tail);
+
+        ropeNode *l, *m, *mid, *rest;
+        ropeSplit(E.buf->rope, row + 1, &l, &m);
+        ropeSplit(m, endrow - row, &mid, &rest);
+        ropeFree(mid);
+        E.buf->rope = ropeMerge(l, rest);
+        E.buf->rope_hit = NULL;
+        E.buf->numrows -= endrow - row;
+    }
+    E.buf->dirty++;
+    editorMarkDirty(row, 1 + endrow - row, 1);
+    E.win->cy = row;
+    E.win->cx = col;
+}
+
+/*** undo ***/
+
+// Changes are logged as records in one growing buffer, holding only the
+// text they inserted or deleted, so undoing a big paste or deletion costs
+// as much as the change itself. Typing or deleting a run of characters
+// extends a single record.
+
+size_t undoSize(size_t len) {
+    return sizeof(undoRecord) + ((len + 7) & ~(size_t)7) + sizeof(size_t);
+}
+
+undoRecord *undoAt(size_t off) {
+    return (undoRecord *)&E.buf->undo.buf[off];
+}
+
+// Offset of the record that ends at `end`.
+size_t undoPrev(size_t end) {
+    size_t size;
+    memcpy(&size, &E.buf->undo.buf[end - sizeof(size_t)], sizeof(size_t));
+    return end - size;
+}
+
+void undoClear() {
+    free(E.buf->undo.buf);
+    E.buf->undo.buf = NULL;
+    E.buf->undo.len = E.buf->undo.cap = E.buf->undo.at = 0;
+    E.buf->undo.open = 0;
+    E.buf->undo.saved = 0;
+    E.buf->undo.sealed = 1;
+}
+
+// Write the record at off, sized for len bytes of text, and its trailer.
+void undoFinish(size_t off, size_t len) {
+    size_t size = undoSize(len);
+    char *text = (char *)(undoAt(off) + 1);
+    memset(&text[len], 0, size - sizeof(undoRecord) - sizeof(size_t) - len);
+    memcpy(&E.buf->undo.buf[off + size - sizeof(size_t)], &size, sizeof(size_t));
+    E.buf->undo.len = E.buf->undo.at = off + size;
+}
+
+void undoReserve(size_t need) {
+    // Drop the oldest steps, a whole step at a time, to stay below the
+    // limit, but never the last record, which may be being extended, nor
+    // the step still open. That one is never walked, so a big step does not
+    // go through all of its records again for each one it adds.
+    if (E.buf->undo.len + need > KILO_UNDO_MEM) {
+        size_t end = E.buf->undo.grouped ? E.buf->undo.open : E.buf->undo.len;
+        size_t drop = 0;
+        while (drop < end && E.buf->undo.len - drop + need > KILO_UNDO_MEM / 4 * 3) {
+            size_t next = drop + undoSize(undoAt(drop)->len);
+            while (next < end && (undoAt(next)->flags & UNDO_CHAIN))
+                next += undoSize(undoAt(next)->len);
+            if (next == E.buf->undo.len) break;
+            drop = next;
+        }
+        memmove(E.buf->undo.buf, &E.buf->undo.buf[drop], E.buf->undo.len - drop);
+        E.buf->undo.len -= drop;
+        E.buf->undo.at -= drop;
+        if (E.buf->undo.grouped) E.buf->undo.open -= drop;
+        E.buf->undo.saved = E.buf->undo.saved >= (long long)drop ? E.buf->undo.saved - (long long)drop : -1;
+    }
+    if (E.buf->undo.len + need > E.buf->undo.cap) {
+        size_t cap = E.buf->undo.cap ? E.buf->undo.cap * 2 : 4096;
+        while (cap < E.buf->undo.len + need) cap *= 2;
+        E.buf->undo.buf = realloc(E.buf->undo.buf, cap);
+        if (E.buf->undo.buf == NULL) die("realloc");
+        E.buf->undo.cap = cap;
+    }
+}
+
+void undoPush(int type, int flags, int row, int col, int endrow, int endcol, const char *s, size_t len) {
+    if (E.buf->undo.dropped) return;
+    // A new change makes what was undone unreachable.
+    E.buf->undo.len = E.buf->undo.at;
+    if (E.buf->undo.saved > (long long)E.buf->undo.at) E.buf->undo.saved = -1;
+    if (E.buf->undo.group && E.buf->undo.grouped) flags |= UNDO_CHAIN;
+    else E.buf->undo.open = E.buf->undo.len;
+    E.buf->undo.grouped = E.buf->undo.group > 0;
+
+    size_t size = undoSize(len);
+    if (size > KILO_UNDO_MEM || (E.buf->undo.grouped && E.buf->undo.len - E.buf->undo.open + size > KILO_UNDO_MEM)) {
+        // Too big to keep; nothing before it can be undone either, nor
+        // the rest of its step.
+        undoClear();
+        E.buf->undo.saved = -1;
+        E.buf->undo.dropped = E.buf->undo.grouped;
+        return;
+    }
+    undoReserve(size);
+    size_t off = E.buf->undo.len;
+    undoRecord *r = undoAt(off);
+    r->type = type;
+    r->flags = flags;
+    r->row = row;
+    r->col = col;
+    r->endrow = endrow;
+    r->endcol = endcol;
+    r->len = len;
+    if (len) memcpy(r + 1, s, len);
+    undoFinish(off, len);
+    E.buf->undo.sealed = 0;
+}
+
+// Log a change made by the user, in the undo log and the journal.
+void undoAdd(int type, int flags, int row, int col, int endrow, int endcol, const char *s, size_t len) {
+    if (E.buf->undo.replaying) return;
+    journalAdd(type, 0, row, col, endrow, endcol, s, len);
+    undoPush(type, flags, row, col, endrow, endcol, s, len);
+}
+
+// Record a character typed at row, col, or a character or line break
+// deleted there by backspace or delete; s holds its len bytes. A run of
+// these extends one record: typing goes on at its end, delete removes what
+// follows its start and backspace what precedes it.
+void undoTyped(int type, int row, int col, const char *s, int len) {
+    int nl = s[0] == '\n';
+    int endrow = nl ? row + 1 : row;
+    int endcol = nl ? 0 : col + len;
+    if (E.buf->undo.replaying) return;
+    journalAdd(type, 0, row, col, endrow, endcol, s, len);
+    if (!E.buf->undo.sealed && !E.buf->undo.group && E.buf->undo.at == E.buf->undo.len && E.buf->undo.at > 0) {
+        size_t off = undoPrev(E.buf->undo.at);
+        undoRecord *r = undoAt(off);
+        int append, prepend = 0;
+        if (type == UNDO_INSERT) {
+            append = r->endrow == row && r->endcol == col;
+        } else {
+            append = r->row == row && r->col == col;
+            prepend = r->row == endrow && r->col == endcol;
+        }
+        if (r->type == type && (r->flags & UNDO_TYPED) && (append || prepend)) {
+            undoReserve(undoSize(r->len + len) - undoSize(r->len));
+            r = undoAt(off);
+            char *text = (char *)(r + 1);
+            if (append) {
+                memcpy(&text[r->len], s, len);
+                r->endrow += endrow - row;
+                r->endcol = nl ? 0 : r->endcol + len;
+            } else {
+                memmove(&text[len], text, r->len);
+                memcpy(text, s, len);
+                r->row = row;
+                r->col = col;
+            }
+            r->len += len;
+            undoFinish(off, r->len);
+            return;
+        }
+    }
+    undoPush(type, UNDO_TYPED, row, col, endrow, endcol, s, len);
+}
+
+// Make the changes until the matching editorUndoEnd() a single step.
+void editorUndoBegin() {
+    E.buf->undo.group++;
+}
+
+void editorUndoEnd() {
+    if (--E.buf->undo.group == 0) E.buf->undo.grouped = E.buf->undo.dropped = 0;
+}
+
+// Apply a change backwards (undo) or forwards.
+void undoApplyChange(int type, int undo, int row, int col, int endrow, int endcol, const char *s, size_t len) {
+    if (type == UNDO_ROW) {
+        if (undo) editorDelRow(row);
+        else editorInsertRow(row, "", 0);
+        E.win->cy = row;
+        E.win->cx = 0;
+    } else if ((type == UNDO_INSERT) == (undo != 0)) {
+        editorDeleteText(row, col, endrow, endcol);
+    } else {
+        E.win->cy = row;
+        E.win->cx = col;
+        editorInsertText(s, len);
+    }
+}
+
+void undoApply(undoRecord *r, int undo) {
+    journalAdd(r->type, undo, r->row, r->col, r->endrow, r->endcol, (char *)(r + 1), r->len);
+    undoApplyChange(r->type, undo, r->row, r->col, r->endrow, r->endcol, (char *)(r + 1), r->len);
+}
+
+void editorUndo() {
+    if (E.buf->undo.at == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    E.buf->undo.replaying = 1;
+    while (E.buf->undo.at > 0) {
+        size_t off = undoPrev(E.buf->undo.at);
+        undoRecord *r = undoAt(off);
+        undoApply(r, 1);
+        E.buf->undo.at = off;
+        if (!(r->flags & UNDO_CHAIN)) break;
+    }
+    E.buf->undo.replaying = 0;
+    E.buf->undo.sealed = 1;
+    if ((long long)E.buf->undo.at == E.buf->undo.saved) E.buf->dirty = 0;
+}
+
+void editorRedo() {
+    if (E.buf->undo.at == E.buf->undo.len) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    E.buf->undo.replaying = 1;
+    do {
+        undoRecord *r = undoAt(E.buf->undo.at);
+        undoApply(r, 0);
+        E.buf->undo.at += undoSize(r->len);
+    } while (E.buf->undo.at < E.buf->undo.len && (undoAt(E.buf->undo.at)->flags & UNDO_CHAIN));
+    E.buf->undo.replaying = 0;
+    E.buf->undo.sealed = 1;
+    if ((long long)E.buf->undo.at == E.buf->undo.saved) E.buf->dirty = 0;
+}
+
+/*** journal ***/
+
+// Every change is also appended to a journal next to the file, so edits
+// that were not saved survive a crash. The main thread only queues the
+// records; a writer thread writes them out and syncs them every
+// KILO_JOURNAL_MS at most, so typing never waits for the disk. Opening a
+// file replays a journal left behind for that version of it.
+
+char *journalPath(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+    char *path = malloc(strlen(filename) + 10);
+    if (path == NULL) die("malloc");
+    sprintf(path, "%.*s.%s.journal", dirlen, filename, &filename[dirlen]);
+    return path;
+}
+
+void journalIdentify(journalHead *h) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "KILOJNL1", 8);
+    h->dev = E.buf->map.st.st_dev;
+    h->ino = E.buf->map.st.st_ino;
+    h->size = E.buf->map.st.st_size;
+    h->sec = E.buf->map.st.st_mtim.tv_sec;
+    h->nsec = E.buf->map.st.st_mtim.tv_nsec;
+}
+
+// FNV-1a over len bytes, going on from sum; start with 2166136261u.
+unsigned int journalHash(unsigned int sum, const void *s, size_t len) {
+    const unsigned char *p = s;
+    size_t j;
+    for (j = 0; j < len; j++) sum = (sum ^ p[j]) * 16777619u;
+    return sum;
+}
+
+// The checksum of a record and its text.
+unsigned int journalSum(const journalRecord *r, const char *s) {
+    journalRecord h = *r;
+    h.sum = 0;
+    return journalHash(journalHash(2166136261u, &h, sizeof(h)), s, r->len);
+}
+
+void journalAdd(int type, int undo, int row, int col, int endrow, int endcol, const char *s, size_t len) {
+    if (!E.buf->journal.running || E.buf->journal.replaying) return;
+    journalRecord r;
+    memset(&r, 0, sizeof(r));
+    r.type = type;
+    r.undo = undo;
+    r.row = row;
+    r.col = col;
+    r.endrow = endrow;
+    r.endcol = endcol;
+    r.len = len;
+    r.sum = journalSum(&r, s);
+
+    pthread_mutex_lock(&E.buf->journal.lock);
+    size_t need = E.buf->journal.len + sizeof(r) + len;
+    if (need > E.buf->journal.cap) {
+        size_t cap = E.buf->journal.cap ? E.buf->journal.cap * 2 : 4096;
+        while (cap < need) cap *= 2;
+        E.buf->journal.buf = realloc(E.buf->journal.buf, cap);
+        if (E.buf->journal.buf == NULL) die("realloc");
+        E.buf->journal.cap = cap;
+    }
+    memcpy(&E.buf->journal.buf[E.buf->journal.len], &r, sizeof(r));
+    if (len) memcpy(&E.buf->journal.buf[E.buf->journal.len + sizeof(r)], s, len);
+    if (E.buf->journal.len == 0) pthread_cond_signal(&E.buf->journal.cond);
+    E.buf->journal.len = need;
+    pthread_mutex_unlock(&E.buf->journal.lock);
+}
+
+int journalWrite(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void *journalWriter(void *arg) {
+    struct journal *j = arg;
+    int fd = -1;
+    pthread_mutex_lock(&j->lock);
+    while (1) {
+        // Nothing is written before the first change, so merely viewing a
+        // file leaves no journal behind.
+        while (!j->stop && j->len == 0)
+            pthread_cond_wait(&j->cond, &j->lock);
+        // Let more changes gather, so they share one write and one sync.
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += KILO_JOURNAL_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        while (!j->stop &&
+               pthread_cond_timedwait(&j->cond, &j->lock, &until) != ETIMEDOUT)
+            ;
+
+        char *buf = j->buf;
+        size_t len = j->len;
+        size_t cap = j->cap;
+        j->buf = j->spare;
+        j->cap = j->sparecap;
+        j->len = 0;
+        int reset = j->reset;
+        journalHead head = j->head;
+        j->reset = 0;
+        int stop = j->stop;
+        pthread_mutex_unlock(&j->lock);
+
+        if (len > 0 && (fd == -1 || reset)) {
+            if (fd == -1) fd = open(j->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+            if (fd != -1 && reset) {
+                if (ftruncate(fd, 0) == -1 || journalWrite(fd, (char *)&head, sizeof(head)) == -1) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+        }
+        // fdatasync() comes from <unistd.h>.
+        if (fd != -1 && len > 0 && journalWrite(fd, buf, len) == 0) fdatasync(fd);
+
+        pthread_mutex_lock(&j->lock);
+        j->spare = buf;
+        j->sparecap = cap;
+        if (stop) break;
+    }
+    pthread_mutex_unlock(&j->lock);
+    if (fd != -1) close(fd);
+    perfMerge();
+    return NULL;
+}
+
+// Start journaling changes to the file as it is now: after opening it,
+// with `fresh` unless a journal was recovered that goes on, or after
+// saving it, which starts the journal over.
+void journalStart(int fresh) {
+    if (E.buf->filename == NULL) return;
+    pthread_mutex_lock(&E.buf->journal.lock);
+    if (fresh) {
+        // Changes still queued are in the file now.
+        E.buf->journal.len = 0;
+        E.buf->journal.reset = 1;
+        journalIdentify(&E.buf->journal.head);
+        pthread_cond_signal(&E.buf->journal.cond);
+    }
+    pthread_mutex_unlock(&E.buf->journal.lock);
+    if (E.buf->journal.running) return;
+
+    free(E.buf->journal.path);
+    E.buf->journal.path = journalPath(E.buf->filename);
+    E.buf->journal.stop = 0;
+    if (pthread_create(&E.buf->journal.thread, NULL, journalWriter, &E.buf->journal) == 0) E.buf->journal.running = 1;
+}
+
+// Stop the writer once it has written everything queued, and delete the
+// journal when its changes are not wanted any more.
+void journalStop(int remove) {
+    if (!E.buf->journal.running) return;
+    pthread_mutex_lock(&E.buf->journal.lock);
+    E.buf->journal.stop = 1;
+    if (remove) E.buf->journal.len = 0;
+    pthread_cond_signal(&E.buf->journal.cond);
+    pthread_mutex_unlock(&E.buf->journal.lock);
+    pthread_join(E.buf->journal.thread, NULL);
+    E.buf->journal.running = 0;
+    if (remove) unlink(E.buf->journal.path);
+}
+
+// Append a JOURNAL_SAVE record to the journal file, once the writer has
+// stopped: text is its journalSaveHead followed by the len bytes to write.
+// Returns 0 once the record is on disk.
+int journalSave(int fd, const char *text, size_t len) {
+    journalRecord r;
+    memset(&r, 0, sizeof(r));
+    r.type = JOURNAL_SAVE;
+    r.len = sizeof(journalSaveHead) + len;
+    r.sum = journalSum(&r, text);
+    if (journalWrite(fd, (char *)&r, sizeof(r)) == -1 || journalWrite(fd, text, r.len) == -1) return -1;
+    return fdatasync(fd);
+}
+
+typedef struct journalReader {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t have;
+    size_t pos;
+} journalReader;
+
+// Make sure the next `need` bytes of the journal are in the buffer, from
+// rd->pos on. Returns 0 when the journal ends before.
+int journalFill(journalReader *rd, size_t need) {
+    if (rd->have - rd->pos >= need) return 1;
+    memmove(rd->buf, &rd->buf[rd->pos], rd->have - rd->pos);
+    rd->have -= rd->pos;
+    rd->pos = 0;
+    if (need > rd->cap) {
+        while (rd->cap < need) rd->cap *= 2;
+        rd->buf = realloc(rd->buf, rd->cap);
+        if (rd->buf == NULL) die("realloc");
+    }
+    while (rd->have < need) {
+        ssize_t n = read(rd->fd, &rd->buf[rd->have], rd->cap - rd->have);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        rd->have += n;
+    }
+    return 1;
+}
+
+// Finish a save in place that was cut short: when the journal holds the
+// bytes of one, they are written over the file again, which leaves it as
+// that save would have. That is only done while the file still holds the
+// bytes they replace, or them already; anything else means another
+// program changed it since. Returns 1 when the save is finished, 0 when
+// the journal holds no such save, -1 when writing failed and -2 when the
+// file changed.
+int journalFinishSave(int fd) {
+    journalReader rd;
+    rd.fd = fd;
+    rd.cap = 1 << 16;
+    rd.buf = malloc(rd.cap);
+    if (rd.buf == NULL) die("malloc");
+    rd.have = rd.pos = 0;
+    int ret = 0;
+    while (ret == 0) {
+        journalRecord r;
+        if (!journalFill(&rd, sizeof(r))) break;
+        memcpy(&r, &rd.buf[rd.pos], sizeof(r));
+        size_t need = sizeof(r) + r.len;
+        if (r.len < 0 || r.len > INT_MAX || !journalFill(&rd, need)) break;
+        const char *text = &rd.buf[rd.pos + sizeof(r)];
+        if (r.sum != journalSum(&r, text)) break;
+        rd.pos += need;
+
+        if (r.type != JOURNAL_SAVE || r.len < (long long)sizeof(journalSaveHead)) continue;
+        journalSaveHead h;
+        memcpy(&h, text, sizeof(h));
+        const char *bytes = text + sizeof(h);
+        size_t len = r.len - sizeof(h);
+        if (E.buf->map.data == NULL || h.at < 0 || (size_t)h.at > E.buf->map.len || len > E.buf->map.len - h.at) {
+            ret = -2;
+            break;
+        }
+        const char *now = &E.buf->map.data[h.at];
+        if (memcmp(now, bytes, len) == 0) {
+            ret = 1;
+        } else if (journalHash(2166136261u, now, len) != h.old) {
+            ret = -2;
+        } else {
+            int file = open(E.buf->filename, O_WRONLY);
+            ret = file != -1 && savePwrite(file, bytes, len, h.at) == 0 && fsync(file) == 0 ? 1 : -1;
+            if (file != -1) close(file);
+        }
+    }
+    free(rd.buf);
+    return ret;
+}
+
+// Replay the journal left for the file just opened, if it was written for
+// this version of it. Records are read in a stream and applied straight to
+// the row buffer, with nothing drawn in between; replay stops at the first
+// record that is cut short or does not fit the text. Returns how many
+// changes were replayed, and cuts off anything after them.
+int journalRecover() {
+    char *path = journalPath(E.buf->filename);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        free(path);
+        return 0;
+    }
+
+    // A save in place that was cut short left the file with the size it
+    // had but not its time.
+    journalHead head, want;
+    journalIdentify(&want);
+    int finished = 0;
+    if (read(fd, &head, sizeof(head)) != sizeof(head) ||
+        memcmp(&head, &want, offsetof(journalHead, sec)) != 0 ||
+        (finished = journalFinishSave(fd)) != 0 ||
+        head.sec != want.sec || head.nsec != want.nsec || lseek(fd, sizeof(head), SEEK_SET) == -1) {
+        close(fd);
+        if (finished == 1) {
+            // The changes are all in the file now.
+            unlink(path);
+            if (editorRemap(E.buf->filename, 0, INT_MAX) == -1) die("mmap");
+            editorSetStatusMessage("Finished saving %.40s, which was cut short", E.buf->filename);
+        } else if (finished == -1) {
+            editorSetStatusMessage("Can't finish saving %.40s: %s", E.buf->filename, strerror(errno));
+        } else if (finished == -2) {
+            editorSetStatusMessage("%.40s changed since saving it was cut short, left as it is", E.buf->filename);
+        }
+        free(path);
+        return 0;
+    }
+    free(path);
+
+    editorIndexAll();
+    journalReader rd;
+    rd.fd = fd;
+    rd.cap = 1 << 16;
+    rd.buf = malloc(rd.cap);
+    if (rd.buf == NULL) die("malloc");
+    rd.have = rd.pos = 0;
+    off_t good = sizeof(head);
+    int count = 0;
+    E.buf->undo.replaying = 1;
+    E.buf->journal.replaying = 1;
+    while (1) {
+        journalRecord r;
+        if (!journalFill(&rd, sizeof(r))) break;
+        memcpy(&r, &rd.buf[rd.pos], sizeof(r));
+        size_t need = sizeof(r) + r.len;
+        if (r.len < 0 || r.len > INT_MAX || !journalFill(&rd, need)) break;
+        const char *text = &rd.buf[rd.pos + sizeof(r)];
+        if (r.sum != journalSum(&r, text)) break;
+
+        // The change has to make sense for the rows as they are.
+        int remove = r.type != UNDO_ROW && (r.type == UNDO_INSERT) == (r.undo != 0);
+        if (r.type == UNDO_ROW) {
+            if (r.undo ? r.row != E.buf->numrows - 1 || editorRowAt(r.row)->size != 0 : r.row != E.buf->numrows)
+                break;
+        } else if (r.row < 0 || r.row >= E.buf->numrows || r.col < 0 || r.col > editorRowAt(r.row)->size) {
+            break;
+        } else if (remove && (r.endrow < r.row || r.endrow >= E.buf->numrows ||
+                              (r.endrow == r.row && r.endcol < r.col) ||
+                              r.endcol < 0 || r.endcol > editorRowAt(r.endrow)->size)) {
+            break;
+        }
+        undoApplyChange(r.type, r.undo, r.row, r.col, r.endrow, r.endcol, text, r.len);
+        rd.pos += need;
+        good += need;
+        count++;
+    }
+    E.buf->undo.replaying = 0;
+    E.buf->journal.replaying = 0;
+    free(rd.buf);
+    if (ftruncate(fd, good) == -1) count = 0;
+    close(fd);
+    return count;
+}
+
+/*** file i/o ***/
+
+// Append the lines of every chunk the indexer has finished, in file order,
+// to the row buffer. Returns how many lines were added.
+int editorIndexPublish() {
+    int added = 0;
+    pthread_mutex_lock(&E.buf->map.lock);
+    while (E.buf->map.published < E.buf->map.nchunks && E.buf->map.chunks[E.buf->map.published].ready) {
+        lineChunk *c = &E.buf->map.chunks[E.buf->map.published++];
+        c->first = E.buf->map.lines;
+        if (c->nlines == 0) continue;
+        E.buf->rope = ropeAppendSpan(E.buf->rope, c->first, c->nlines);
+        E.buf->rope_hit = NULL;
+        E.buf->map.lines += c->nlines;
+        E.buf->numrows += c->nlines;
+        added += c->nlines;
+    }
+    pthread_mutex_unlock(&E.buf->map.lock);
+
+    if (!E.buf->map.done && E.buf->map.published == E.buf->map.nchunks) {
+        mapStopIndexer(&E.buf->map);
+        E.buf->map.done = 1;
+    }
+    return added;
+}
+
+// Make sure the file is indexed at least up to line `at`.
+void editorIndexUpTo(int at) {
+    editorIndexPublish();
+    while (!E.buf->map.done && E.buf->map.lines <= at) {
+        mapWaitChunk(&E.buf->map, E.buf->map.published);
+        editorIndexPublish();
+    }
+}
+
+void editorIndexAll() {
+    while (!E.buf->map.done) editorIndexUpTo(E.buf->map.lines);
+}
+
+// Add what was written to the end of a followed file since the last
+// frame. The new bytes are mapped behind the old ones and indexed, and
+// their lines appended as spans like those of a newly opened file, so a
+// fast writer costs one batch per frame. Growth is left for later while
+// the indexer or a search still use the line index.
+void editorFollow() {
+    if (!E.buf->follow_pending || !E.buf->map.done || E.buf->map.data == NULL) return;
+    if (E.search.active && E.search.buf == E.buf) return;
+    E.buf->follow_pending = 0;
+
+    int fd = open(E.buf->filename, O_RDONLY);
+    if (fd == -1) return;
+    struct stat st;
+    size_t old = E.buf->map.len;
+    int grown = fstat(fd, &st) == 0 && st.st_dev == E.buf->map.st.st_dev &&
+        st.st_ino == E.buf->map.st.st_ino && (size_t)st.st_size > old &&
+        (size_t)st.st_size <= KILO_FOLLOW_RESERVE;
+    if (grown) {
+        // The mapping is extended from the page the old end is on.
+        size_t from = old - old % sysconf(_SC_PAGESIZE);
+        if (mmap(&E.buf->map.data[from], st.st_size - from, PROT_READ,
+                 MAP_PRIVATE | MAP_FIXED, fd, from) == MAP_FAILED)
+            grown = 0;
+    }
+    close(fd);
+    if (!grown) return;
+
+    int rows = E.buf->numrows;
+    E.buf->map.len = st.st_size;
+    E.buf->map.st = st;
+    int added = mapGrow(&E.buf->map, old);
+
+    // A last line that had no newline yet goes on in the new bytes. Unread
+    // it is read at its new length anyway, a row read from the mapping and
+    // not edited since is made longer.
+    if (old > 0 && E.buf->map.data[old - 1] != '\n') {
+        int at = E.buf->map.lines - 1;
+        if (E.buf->save_lo != -1) at = at >= E.buf->save_tail ? at - E.buf->save_tail + E.buf->save_hi : -1;
+        int start;
+        ropeNode *t = at >= 0 ? ropeFind(at, &start) : NULL;
+        erow *row = t && t->rows ? &t->rows[at - start] : NULL;
+        if (row && row->mapped) {
+            int size = row->size;
+            size_t next;
+            row->size = mapLineLength(&E.buf->map, row->chars - E.buf->map.data, &next);
+            editorUpdateRow(row, size);
+        }
+    }
+
+    if (added > 0) {
+        E.buf->rope = ropeAppendSpan(E.buf->rope, E.buf->map.lines, added);
+        E.buf->rope_hit = NULL;
+        E.buf->map.lines += added;
+        E.buf->numrows += added;
+    }
+    editorIndexAll();
+    // The last row may have grown as well as the rows after it.
+    if (rows > 0) filterEdit(rows - 1, 1, E.buf->numrows - rows + 1);
+    else filterEdit(0, 0, E.buf->numrows);
+
+    // Windows with the cursor on the last line keep showing the end.
+    struct editorWindow *w;
+    for (w = E.windows; w; w = w->next) {
+        if (w->buf != E.buf || w->cy < rows - 1 || E.buf->numrows <= rows) continue;
+        w->cy = w->cy >= rows ? E.buf->numrows : E.buf->numrows - 1;
+        w->cx = 0;
+    }
+}
+
+// Saving streams the row buffer straight to the file: rows and unread
+// spans of the mapping are gathered into iovecs and written in batches, so
+// saving needs no copy of the file in memory. A writer without a file
+// only counts the bytes, or copies them to buf when it has one.
+typedef struct saveWriter {
+    int fd;
+    char *buf;
+    struct iovec iov[KILO_SAVE_IOV];
+    int n;
+    long long bytes;
+    int failed;
+} saveWriter;
+
+void saveFlush(saveWriter *w) {
+    struct iovec *iov = w->iov;
+    int n = w->n;
+    w->n = 0;
+    while (n > 0 && !w->failed) {
+        // writev() comes from <sys/uio.h>.
+        ssize_t done = writev(w->fd, iov, n);
+        if (done == -1) {
+            if (errno == EINTR) continue;
+            w->failed = 1;
+            return;
+        }
+        // Skip what was written, which may end inside an iovec.
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+void saveAdd(saveWriter *w, const char *s, size_t len) {
+    if (len == 0) return;
+    if (w->fd == -1) {
+        if (w->buf) memcpy(&w->buf[w->bytes], s, len);
+        w->bytes += len;
+        return;
+    }
+    if (w->n == KILO_SAVE_IOV) saveFlush(w);
+    w->iov[w->n].iov_base = (void *)s;
+    w->iov[w->n].iov_len = len;
+    w->n++;
+    w->bytes += len;
+}
+
+void saveLine(saveWriter *w, const char *s, int len) {
+    saveAdd(w, s, len);
+    saveAdd(w, "\n", 1);
+}
+
+// Write bytes from .. to - 1 of the mapping as they are.
+void saveMapped(saveWriter *w, size_t from, size_t to) {
+    while (from < to) {
+        size_t len = to - from < KILO_SAVE_SPAN ? to - from : KILO_SAVE_SPAN;
+        saveAdd(w, &E.buf->map.data[from], len);
+        from += len;
+    }
+}
+
+// A span goes out as its bytes in the mapping when those are exactly its
+// lines, each ending in \n. Lines ending in \r\n, or a last line without
+// a line break, are written one by one.
+void saveSpan(saveWriter *w, int first, int n) {
+    size_t p = mapLineOffset(&E.buf->map, first);
+    size_t end = mapLineStart(&E.buf->map, first + n);
+    if (end > p && E.buf->map.data[end - 1] == '\n' && memchr(&E.buf->map.data[p], '\r', end - p) == NULL) {
+        saveMapped(w, p, end);
+        return;
+    }
+    int j;
+    for (j = 0; j < n; j++) {
+        size_t next;
+        int len = mapLineLength(&E.buf->map, p, &next);
+        saveLine(w, &E.buf->map.data[p], len);
+        p = next;
+    }
+}
+
+// Write rows lo .. hi - 1 of the subtree t, whose first row is row base.
+void saveRows(saveWriter *w, ropeNode *t, int base, int lo, int hi) {
+    if (t == NULL || w->failed) return;
+    int start = base + ropeCount(t->left);
+    int end = start + t->n;
+    if (lo < start) saveRows(w, t->left, base, lo, hi);
+    int from = lo > start ? lo : start;
+    int to = hi < end ? hi : end;
+    if (from < to) {
+        if (t->rows) {
+            int j;
+            for (j = from; j < to; j++) saveLine(w, t->rows[j - start].chars, t->rows[j - start].size);
+        } else {
+            saveSpan(w, t->first + from - start, to - from);
+        }
+    }
+    if (hi > end) saveRows(w, t->right, end, lo, hi);
+}
+
+int savePread(int fd, char *buf, size_t len, off_t at) {
+    while (len > 0) {
+        // pread() and pwrite() come from <unistd.h>.
+        ssize_t n = pread(fd, buf, len, at);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        at += n;
+    }
+    return 0;
+}
+
+int savePwrite(int fd, const char *buf, size_t len, off_t at) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, at);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        at += n;
+    }
+    return 0;
+}
+
+// Map the file at path again after it was saved and rebuild the row
+// buffer on it. The line index of chunks before `keep` and from `resume`
+// on is still right and only the ones between are scanned again, or the
+// whole file is when keep is 0 and nothing follows. Returns -1 and leaves
+// everything as it was when the file cannot be mapped.
+int editorRemap(const char *path, int keep, int resume) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    struct stat st;
+    void *data = NULL;
+    if (fstat(fd, &st) == -1) data = MAP_FAILED;
+    else data = mapFile(&E.buf->map, fd, st.st_size);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    editorSearchStop();
+    mapStopIndexer(&E.buf->map);
+    ropeFree(E.buf->rope);
+    E.buf->rope = NULL;
+    E.buf->rope_hit = NULL;
+    E.buf->numrows = 0;
+    mapUnmap(&E.buf->map);
+    E.buf->map.data = data;
+    E.buf->map.len = st.st_size;
+    E.buf->map.st = st;
+    E.buf->map.published = 0;
+    E.buf->map.lines = 0;
+
+    int nchunks = (E.buf->map.len + KILO_INDEX_CHUNK - 1) / KILO_INDEX_CHUNK;
+    if (resume > nchunks) resume = nchunks;
+    int k;
+    for (k = keep; k < E.buf->map.nchunks; k++) {
+        if (k < resume || k >= nchunks) free(E.buf->map.chunks[k].marks);
+    }
+    if (keep == 0 && resume == nchunks) {
+        free(E.buf->map.chunks);
+        E.buf->map.chunks = NULL;
+        E.buf->map.nchunks = 0;
+        E.buf->map.done = 1;
+        if (nchunks > 0) mapStartIndexer(&E.buf->map);
+    } else {
+        E.buf->map.chunks = realloc(E.buf->map.chunks, sizeof(lineChunk) * nchunks);
+        if (E.buf->map.chunks == NULL) die("realloc");
+        for (k = E.buf->map.nchunks; k < nchunks; k++) E.buf->map.chunks[k].ready = 0;
+        E.buf->map.nchunks = nchunks;
+        for (k = keep; k < nchunks; k++) {
+            if (k >= resume && E.buf->map.chunks[k].ready) continue;
+            mapScanChunk(&E.buf->map, &E.buf->map.chunks[k], (size_t)k * KILO_INDEX_CHUNK);
+            E.buf->map.chunks[k].ready = 1;
+        }
+        E.buf->map.done = 1;
+    }
+    editorIndexPublish();
+    editorIndexAll();
+    return 0;
+}
+
+// Save by rewriting only what changed, in place: the rows from save_lo
+// to save_hi, when they take as many bytes as the lines they replace.
+// That is only possible while the file is still the one that is mapped
+// and saving it in full would give back its unchanged bytes as they are.
+// The new bytes go to the journal first, so opening the file after a
+// crash halfway can finish the save, and when writing them fails the
+// file is written in full from them and the mapping instead. Returns 1
+// when saved, with the chunks of the line index that are still right in
+// *keep and *resume, and 0 when the file has to be written in full.
+int editorSaveInPlace(const char *target, long long *written, int *keep, int *resume) {
+    struct stat st;
+    if (E.buf->map.data == NULL || E.buf->map.len == 0 || stat(target, &st) == -1) return 0;
+    if (st.st_dev != E.buf->map.st.st_dev || st.st_ino != E.buf->map.st.st_ino ||
+        (size_t)st.st_size != E.buf->map.len ||
+        st.st_mtim.tv_sec != E.buf->map.st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != E.buf->map.st.st_mtim.tv_nsec)
+        return 0;
+    if (E.buf->map.data[E.buf->map.len - 1] != '\n') return 0;
+    int k;
+    for (k = 0; k < E.buf->map.nchunks; k++)
+        if (E.buf->map.chunks[k].cr) return 0;
+
+    *written = 0;
+    *keep = *resume = E.buf->map.nchunks;
+    if (E.buf->save_lo == -1) return 1;
+    if (E.buf->numrows - E.buf->save_hi != E.buf->map.lines - E.buf->save_tail) return 0;
+    if (!E.buf->journal.running) return 0;
+
+    saveWriter w;
+    w.fd = -1;
+    w.buf = NULL;
+    w.n = 0;
+    w.bytes = 0;
+    w.failed = 0;
+    saveRows(&w, E.buf->rope, 0, E.buf->save_lo, E.buf->save_hi);
+    size_t off = mapLineStart(&E.buf->map, E.buf->save_lo);
+    size_t oldend = mapLineStart(&E.buf->map, E.buf->save_tail);
+    if ((size_t)w.bytes != oldend - off) return 0;
+    if (w.bytes > KILO_SAVE_REGION || w.bytes > (long long)E.buf->map.len / 2) return 0;
+
+    // The new rows go to a buffer first, as rows not edited still point
+    // into the mapping, which shows the bytes being overwritten. It starts
+    // with the head of their journal record.
+    journalSaveHead h;
+    memset(&h, 0, sizeof(h));
+    h.at = off;
+    h.old = journalHash(2166136261u, &E.buf->map.data[off], w.bytes);
+    char *text = malloc(sizeof(h) + w.bytes + 1);
+    if (text == NULL) die("malloc");
+    memcpy(text, &h, sizeof(h));
+    w.buf = text + sizeof(h);
+    w.bytes = 0;
+    saveRows(&w, E.buf->rope, 0, E.buf->save_lo, E.buf->save_hi);
+
+    // The writer is stopped so the record goes right after the changes it
+    // has queued; saving starts the journal over afterwards.
+    journalStop(0);
+    int jfd = open(E.buf->journal.path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    off_t jlen = jfd == -1 ? -1 : lseek(jfd, 0, SEEK_END);
+    int fd = -1;
+    if (jlen != -1 && journalSave(jfd, text, w.bytes) == 0) fd = open(target, O_WRONLY);
+    if (fd == -1) {
+        // Nothing was written; the journal goes on as it was.
+        if (jlen != -1 && ftruncate(jfd, jlen) == -1) unlink(E.buf->journal.path);
+        if (jfd != -1) close(jfd);
+        free(text);
+        journalStart(0);
+        return 0;
+    }
+
+    int ret = savePwrite(fd, w.buf, w.bytes, off);
+    if (ret == 0) ret = fsync(fd);
+    if (close(fd) == -1 && ret == 0) ret = -1;
+    if (ret == 0) {
+        *written = w.bytes;
+        *keep = off / KILO_INDEX_CHUNK;
+        *resume = (off + w.bytes) / KILO_INDEX_CHUNK + 1;
+    } else {
+        // Part of the new bytes may be in the file, so the old version of
+        // it is gone; the rows still reading it are rebuilt on the new one.
+        if (editorSaveFull(target, written, w.buf, off, w.bytes) == -1) die("write");
+        *keep = 0;
+        *resume = INT_MAX;
+    }
+    if (ftruncate(jfd, 0) == -1) unlink(E.buf->journal.path);
+    close(jfd);
+    free(text);
+    return 1;
+}
+
+// Watch the open file for changes made by other programs.
+void editorWatchFile() {
+#ifdef __linux__
+    if (E.buf->filename == NULL) return;
+    if (E.notify_fd == -1) {
+        E.notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (E.notify_fd == -1) return;
+    }
+    if (E.buf->notify_wd != -1) inotify_rm_watch(E.notify_fd, E.buf->notify_wd);
+    E.buf->notify_wd = inotify_add_watch(E.notify_fd, E.buf->filename,
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (stat(E.buf->filename, &E.buf->filestat) == -1) memset(&E.buf->filestat, 0, sizeof(E.buf->filestat));
+#endif
+}
+
+// Check the current buffer's file after an event on it.
+void editorFileChanged(int rewatch) {
+#ifdef __linux__
+    // Our own saves trigger events too; only report what we did not write.
+    struct stat st;
+    if (stat(E.buf->filename, &st) == -1) {
+        editorSetStatusMessage("%.40s was removed from disk", E.buf->filename);
+    } else if (E.buf->map.follow && st.st_ino == E.buf->filestat.st_ino && st.st_size >= E.buf->filestat.st_size) {
+        // Growth is added by the next frame, see editorFollow().
+        E.buf->follow_pending = 1;
+        E.buf->filestat = st;
+    } else if (st.st_ino != E.buf->filestat.st_ino || st.st_size != E.buf->filestat.st_size ||
+               st.st_mtime != E.buf->filestat.st_mtime) {
+        editorSetStatusMessage("%.40s changed on disk", E.buf->filename);
+        E.buf->filestat = st;
+    }
+    if (rewatch) editorWatchFile();
+#else
+    (void)rewatch;
+#endif
+}
+
+void editorFileEvent() {
+#ifdef __linux__
+    char buf[4096];
+    ssize_t n;
+    struct editorBuffer *cur = E.buf;
+    while ((n = read(E.notify_fd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (p < buf + n) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            struct editorBuffer *b;
+            for (b = E.buffers; b; b = b->next) {
+                if (b->notify_wd != ev->wd) continue;
+                E.buf = b;
+                editorFileChanged(ev->mask & (IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF));
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    E.buf = cur;
+    editorScheduleRedraw();
+#endif
+}
+
+void editorOpen(char *filename) {
+    // strdup() comes from <string.h>
+    free(E.buf->filename);
+    // E.buf->filename = strdup(filename);-----------------------------------------------------------------------------------------------
+    E.buf->filename = filename;
+    editorSelectSyntaxHighlight();
+
+    // Regular files are mapped and indexed lazily, only what the screen
+    // needs is read before the first frame.
+    // fstat() and struct stat come from <sys/stat.h>.
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size > 0 || E.buf->map.follow) {
+            void *data = mapFile(&E.buf->map, fd, st.st_size);
+            if (data != MAP_FAILED) {
+                E.buf->map.data = data;
+                E.buf->map.len = st.st_size;
+                if (st.st_size > 0) mapStartIndexer(&E.buf->map);
+            }
+        }
+        if (E.buf->map.data || st.st_size == 0) {
+            close(fd);
+            E.buf->map.st = st;
+            editorIndexUpTo(E.win->screenrows);
+            E.buf->dirty = 0;
+            E.buf->save_lo = -1;
+            E.buf->hl.lo = -1;
+            editorWatchFile();
+            int recovered = journalRecover();
+            if (recovered > 0) {
+                // The file on disk does not have these changes yet.
+                E.buf->undo.saved = -1;
+                E.win->cy = E.win->cx = 0;
+                editorSetStatusMessage("Recovered %d unsaved changes from the journal", recovered);
+            }
+            journalStart(recovered == 0);
+            return;
+        }
+    }
+    if (fd != -1) close(fd);
+
+    // FILE, fopen(), and getline() come from <stdio.h>.
+    FILE *fp = fopen(filename, "r");
+    if (!fp) die("fopen");
+    
+    char *line = NULL;
+    size_t linecap = 0;
+    // malloc() comes from <stdlib.h>. ssize_t comes from <sys/types.h>
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        // remove the \n or \r from linelen
+        while (linelen > 0 &&  (line[linelen - 1] == '\n' || 
+                                line[linelen - 1] == '\r'))
+            linelen--;
+        editorInsertRow(E.buf->numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+    E.buf->dirty = 0;
+    E.buf->save_lo = -1;
+    E.buf->hl.lo = -1;
+    editorWatchFile();
+}
+
+// Write the whole file under a temporary name next to it and rename it
+// over the file once it is safely on disk, so a failed save leaves the old
+// file as it was. With a patch, the file is the mapping with the len bytes
+// at `at` replaced by it instead of the rows. Returns 0, or -1 with errno
+// set.
+int editorSaveFull(const char *target, long long *written, const char *patch, size_t at, size_t len) {
+    // mkstemp() comes from <stdlib.h>.
+    char *tmp = malloc(strlen(target) + 8);
+    if (tmp == NULL) die("malloc");
+    sprintf(tmp, "%s.XXXXXX", target);
+
+    saveWriter w;
+    w.buf = NULL;
+    w.n = 0;
+    w.bytes = 0;
+    w.failed = 0;
+    w.fd = mkstemp(tmp);
+    if (w.fd == -1) {
+        free(tmp);
+        return -1;
+    }
+
+    // Keep the permissions of the file being replaced; a new one gets the
+    // usual 0644 less the umask.
+    struct stat st;
+    if (stat(target, &st) == 0) {
+        fchmod(w.fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(w.fd, 0644 & ~mask);
+    }
+
+    if (patch) {
+        saveMapped(&w, 0, at);
+        saveAdd(&w, patch, len);
+        saveMapped(&w, at + len, E.buf->map.len);
+    } else {
+        saveRows(&w, E.buf->rope, 0, 0, E.buf->numrows);
+    }
+    saveFlush(&w);
+    int err = w.failed ? errno : 0;
+    if (!err && fsync(w.fd) == -1) err = errno;
+    if (close(w.fd) == -1 && !err) err = errno;
+    if (!err && rename(tmp, target) == -1) err = errno;
+    if (err) {
+        unlink(tmp);
+        free(tmp);
+        errno = err;
+        return -1;
+    }
+    free(tmp);
+
+    // Make the rename itself durable.
+    char *dir = strdup(target);
+    if (dir == NULL) die("malloc");
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    int dfd = open(slash ? (slash == dir ? "/" : dir) : ".", O_RDONLY);
+    if (dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+    free(dir);
+    *written = w.bytes;
+    return 0;
+}
+
+void editorSave() {
+    if (E.buf->filename == NULL) {
+        E.buf->filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+        if (E.buf->filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+    editorIndexAll();
+
+    // realpath() comes from <stdlib.h>; a symlink is followed so the file
+    // it points to is the one written.
+    char *target = realpath(E.buf->filename, NULL);
+    if (target == NULL) target = strdup(E.buf->filename);
+    if (target == NULL) die("malloc");
+
+    // Afterwards the rows are read from the saved file, so the next save
+    // can again tell what changed since.
+    long long written;
+    int keep, resume;
+    if (editorSaveInPlace(target, &written, &keep, &resume)) {
+        // The mapping may already show part of the new file, so the rows
+        // have to be rebuilt on it whatever it takes.
+        if (editorRemap(target, keep, resume) == -1) die("mmap");
+    } else if (editorSaveFull(target, &written, NULL, 0, 0) == 0) {
+        editorRemap(target, 0, INT_MAX);
+    } else {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        free(target);
+        return;
+    }
+    free(target);
+
+    E.buf->dirty = 0;
+    E.buf->save_lo = -1;
+    E.buf->undo.saved = E.buf->undo.at;
+    E.buf->undo.sealed = 1;
+    journalStart(1);
+    // After a full save the name belongs to a new file, watch that one.
+    editorWatchFile();
+    editorSetStatusMessage("%lld bytes written to disk", written);
+}
+
+/*** regex ***/
+
+// Patterns are parsed into a tree, compiled to a Thompson NFA, and run as
+// a DFA whose states are only built when a scan first reaches them. Once
+// built, a state costs one table lookup per byte, and a new state costs
+// one pass over the NFA. Nothing ever backtracks, so a scan is linear in
+// the text whatever the pattern. The cache of states is dropped and built
+// again when it fills up, which bounds its memory.
+
+typedef struct reParser {
+    const char *p;
+    const char *err;
+} reParser;
+
+reNode *reNew(int type, reNode *a, reNode *b) {
+    reNode *n = calloc(1, sizeof(reNode));
+    if (n == NULL) die("calloc");
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    return n;
+}
+
+void reFreeNode(reNode *n) {
+    if (n == NULL) return;
+    reFreeNode(n->a);
+    reFreeNode(n->b);
+    free(n);
+}
+
+void reClassSet(unsigned char *cls, int lo, int hi) {
+    int c;
+    for (c = lo; c <= hi; c++) cls[c >> 3] |= 1 << (c & 7);
+}
+
+void reClassInvert(unsigned char *cls) {
+    int j;
+    for (j = 0; j < 32; j++) cls[j] = ~cls[j];
+}
+
+// \d, \w and \s and their negations add to cls; returns 0 for any other
+// escape.
+int reClassEscape(int c, unsigned char *cls) {
+    unsigned char set[32];
+    memset(set, 0, sizeof(set));
+    switch (tolower(c)) {
+        case 'd':
+            reClassSet(set, '0', '9');
+            break;
+        case 'w':
+            reClassSet(set, '0', '9');
+            reClassSet(set, 'a', 'z');
+            reClassSet(set, 'A', 'Z');
+            reClassSet(set, '_', '_');
+            break;
+        case 's':
+            reClassSet(set, ' ', ' ');
+            reClassSet(set, '\t', '\r');
+            break;
+        default:
+            return 0;
+    }
+    if (isupper(c)) reClassInvert(set);
+    int j;
+    for (j = 0; j < 32; j++) cls[j] |= set[j];
+    return 1;
+}
+
+int reEscapeChar(int c) {
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+    }
+    return c;
+}
+
+reNode *reParseAlt(reParser *ps);
+
+reNode *reParseClass(reParser *ps) {
+    reNode *n = reNew(RN_CLASS, NULL, NULL);
+    int neg = 0;
+    if (*ps->p == '^') {
+        neg = 1;
+        ps->p++;
+    }
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        first = 0;
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\') {
+            if (*ps->p == '\0') break;
+            int c = (unsigned char)*ps->p++;
+            if (reClassEscape(c, n->cls)) continue;
+            lo = reEscapeChar(c);
+        }
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            ps->p++;
+            hi = (unsigned char)*ps->p++;
+            if (hi == '\\' && *ps->p) hi = reEscapeChar((unsigned char)*ps->p++);
+            if (hi < lo) ps->err = "bad range in []";
+        }
+        reClassSet(n->cls, lo, hi);
+    }
+    if (*ps->p != ']') {
+        ps->err = "missing ]";
+        return n;
+    }
+    ps->p++;
+    if (neg) reClassInvert(n->cls);
+    return n;
+}
+
+reNode *reParseAtom(reParser *ps) {
+    int c = (unsigned char)*ps->p++;
+    reNode *n;
+    switch (c) {
+        case '(':
+            n = reParseAlt(ps);
+            if (*ps->p == ')') ps->p++;
+            else ps->err = "missing )";
+            return n;
+        case '[':
+            return reParseClass(ps);
+        case '^':
+            return reNew(RN_BOL, NULL, NULL);
+        case '$':
+            return reNew(RN_EOL, NULL, NULL);
+        case '*':
+        case '+':
+        case '?':
+            ps->err = "nothing to repeat";
+            return reNew(RN_EMPTY, NULL, NULL);
+    }
+
+    n = reNew(RN_CLASS, NULL, NULL);
+    if (c == '.') {
+        reClassSet(n->cls, 0, 255);
+    } else if (c == '\\') {
+        if (*ps->p == '\0') {
+            ps->err = "trailing \\";
+            return n;
+        }
+        c = (unsigned char)*ps->p++;
+        if (!reClassEscape(c, n->cls)) reClassSet(n->cls, reEscapeChar(c), reEscapeChar(c));
+    } else {
+        reClassSet(n->cls, c, c);
+    }
+    return n;
+}
+
+// Reads "{m}", "{m,}" or "{m,n}". Anything else is not a count, and the
+// brace is then taken literally.
+int reParseCount(reParser *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+    if (!isdigit((unsigned char)*p)) return 0;
+    *min = 0;
+    for (; isdigit((unsigned char)*p); p++)
+        if (*min <= KILO_RE_REPEAT) *min = *min * 10 + (*p - '0');
+    *max = *min;
+    if (*p == ',') {
+        p++;
+        *max = -1;
+        if (isdigit((unsigned char)*p)) {
+            *max = 0;
+            for (; isdigit((unsigned char)*p); p++)
+                if (*max <= KILO_RE_REPEAT) *max = *max * 10 + (*p - '0');
+        }
+    }
+    if (*p != '}') return 0;
+    ps->p = p + 1;
+    if (*min > KILO_RE_REPEAT || *max > KILO_RE_REPEAT) ps->err = "repeat count too large";
+    else if (*max != -1 && *max < *min) ps->err = "bad repeat count";
+    return 1;
+}
+
+reNode *reParseRepeat(reParser *ps) {
+    reNode *n = reParseAtom(ps);
+    while (1) {
+        int min = 0, max = -1;
+        char c = *ps->p;
+        if (c == '*' || c == '+' || c == '?') {
+            if (c == '+') min = 1;
+            if (c == '?') max = 1;
+            ps->p++;
+        } else if (c != '{' || !reParseCount(ps, &min, &max)) {
+            return n;
+        }
+        n = reNew(RN_REPEAT, n, NULL);
+        n->min = min;
+        n->max = max;
+    }
+}
+
+reNode *reParseCat(reParser *ps) {
+    reNode *n = NULL;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')' && ps->err == NULL) {
+        reNode *r = reParseRepeat(ps);
+        n = n ? reNew(RN_CAT, n, r) : r;
+    }
+    return n ? n : reNew(RN_EMPTY, NULL, NULL);
+}
+
+reNode *reParseAlt(reParser *ps) {
+    reNode *n = reParseCat(ps);
+    while (*ps->p == '|' && ps->err == NULL) {
+        ps->p++;
+        n = reNew(RN_ALT, n, reParseCat(ps));
+    }
+    return n;
+}
+
+int reNullable(reNode *n) {
+    switch (n->type) {
+        case RN_CLASS: return 0;
+        case RN_CAT: return reNullable(n->a) && reNullable(n->b);
+        case RN_ALT: return reNullable(n->a) || reNullable(n->b);
+        case RN_REPEAT: return n->min == 0 || reNullable(n->a);
+    }
+    return 1;
+}
+
+// Instructions n compiles to, saturating at KILO_RE_INSTS + 1.
+long reSize(reNode *n) {
+    long s = 0;
+    switch (n->type) {
+        case RN_CLASS:
+        case RN_BOL:
+        case RN_EOL:
+            s = 1;
+            break;
+        case RN_CAT:
+            s = reSize(n->a) + reSize(n->b);
+            break;
+        case RN_ALT:
+            s = reSize(n->a) + reSize(n->b) + 2;
+            break;
+        case RN_REPEAT: {
+            long a = reSize(n->a);
+            s = n->min * a + (n->max == -1 ? a + 2 : (n->max - n->min) * (a + 1));
+            break;
+        }
+    }
+    return s > KILO_RE_INSTS ? KILO_RE_INSTS + 1 : s;
+}
+
+int reEmit(reProg *prog, int op) {
+    int i = prog->n++;
+    reInst *in = &prog->inst[i];
+    memset(in, 0, sizeof(reInst));
+    in->op = op;
+    in->out = i + 1;
+    return i;
+}
+
+// Compile n into prog. The reversed program matches the text backwards:
+// concatenations run right to left and the two anchors trade places.
+void reCompileNode(reProg *prog, reNode *n, int reversed) {
+    int i, j, k;
+    switch (n->type) {
+        case RN_CLASS:
+            i = reEmit(prog, RE_BYTE);
+            memcpy(prog->inst[i].cls, n->cls, 32);
+            break;
+        case RN_BOL:
+            reEmit(prog, reversed ? RE_EOL : RE_BOL);
+            break;
+        case RN_EOL:
+            reEmit(prog, reversed ? RE_BOL : RE_EOL);
+            break;
+        case RN_CAT:
+            reCompileNode(prog, reversed ? n->b : n->a, reversed);
+            reCompileNode(prog, reversed ? n->a : n->b, reversed);
+            break;
+        case RN_ALT:
+            i = reEmit(prog, RE_SPLIT);
+            reCompileNode(prog, n->a, reversed);
+            j = reEmit(prog, RE_JMP);
+            prog->inst[i].out1 = prog->n;
+            reCompileNode(prog, n->b, reversed);
+            prog->inst[j].out = prog->n;
+            break;
+        case RN_REPEAT:
+            for (k = 0; k < n->min; k++) reCompileNode(prog, n->a, reversed);
+            if (n->max == -1) {
+                i = reEmit(prog, RE_SPLIT);
+                reCompileNode(prog, n->a, reversed);
+                j = reEmit(prog, RE_JMP);
+                prog->inst[j].out = i;
+                prog->inst[i].out1 = prog->n;
+            } else {
+                for (k = n->min; k < n->max; k++) {
+                    i = reEmit(prog, RE_SPLIT);
+                    reCompileNode(prog, n->a, reversed);
+                    prog->inst[i].out1 = prog->n;
+                }
+            }
+            break;
+    }
+}
+
+void reProgInit(reProg *prog, reNode *n, int reversed) {
+    prog->inst = malloc(sizeof(reInst) * (reSize(n) + 1));
+    if (prog->inst == NULL) die("malloc");
+    prog->n = 0;
+    reCompileNode(prog, n, reversed);
+    reEmit(prog, RE_MATCH);
+    prog->nullable = reNullable(n);
+}
+
+// The one byte n matches, or -1.
+int reSingleByte(reNode *n) {
+    if (n->type != RN_CLASS) return -1;
+    int c, found = -1;
+    for (c = 0; c < 256; c++) {
+        if (n->cls[c >> 3] & (1 << (c & 7))) {
+            if (found != -1) return -1;
+            found = c;
+        }
+    }
+    return found;
+}
+
+typedef struct reMust {
+    char *best;
+    int bestlen;
+    char run[KILO_RE_MUST];
+    int len;
+} reMust;
+
+void reMustEnd(reMust *m) {
+    if (m->len > m->bestlen) {
+        memcpy(m->best, m->run, m->len);
+        m->bestlen = m->len;
+    }
+    m->len = 0;
+}
+
+void reMustAdd(reMust *m, int c) {
+    if (m->len == KILO_RE_MUST) reMustEnd(m);
+    m->run[m->len++] = c;
+}
+
+// Walk the top level sequence of the pattern, collecting runs of bytes
+// that every match has to contain one after the other.
+void reMustWalk(reNode *n, reMust *m) {
+    int c, k;
+    switch (n->type) {
+        case RN_CAT:
+            reMustWalk(n->a, m);
+            reMustWalk(n->b, m);
+            return;
+        case RN_BOL:
+        case RN_EOL:
+        case RN_EMPTY:
+            return;
+        case RN_CLASS:
+            c = reSingleByte(n);
+            if (c == -1) break;
+            reMustAdd(m, c);
+            return;
+        case RN_REPEAT:
+            c = reSingleByte(n->a);
+            if (c == -1 || n->min == 0) break;
+            for (k = 0; k < n->min && k < KILO_RE_MUST; k++) reMustAdd(m, c);
+            if (n->max != n->min) reMustEnd(m);
+            return;
+    }
+    reMustEnd(m);
+}
+
+// The longest literal every match of pattern contains, in must (which
+// holds KILO_RE_MUST bytes). Returns its length, 0 if there is none.
+int reMustLiteral(const char *pattern, char *must) {
+    reParser ps;
+    ps.p = pattern;
+    ps.err = NULL;
+    reNode *n = reParseAlt(&ps);
+    reMust m;
+    m.best = must;
+    m.bestlen = 0;
+    m.len = 0;
+    if (ps.err == NULL) {
+        reMustWalk(n, &m);
+        reMustEnd(&m);
+    }
+    reFreeNode(n);
+    return m.bestlen;
+}
+
+// Compile pattern into a forward and a reversed program. Returns an error
+// message, or NULL when the pattern is good.
+const char *reCompile(const char *pattern, reProg *fwd, reProg *rev) {
+    reParser ps;
+    ps.p = pattern;
+    ps.err = NULL;
+    reNode *n = reParseAlt(&ps);
+    if (ps.err == NULL && *ps.p == ')') ps.err = "unmatched )";
+    if (ps.err == NULL && reSize(n) > KILO_RE_INSTS) ps.err = "pattern too large";
+    if (ps.err == NULL) {
+        reProgInit(fwd, n, 0);
+        reProgInit(rev, n, 1);
+    }
+    reFreeNode(n);
+    return ps.err;
+}
+
+void reProgFree(reProg *prog) {
+    free(prog->inst);
+    prog->inst = NULL;
+    prog->n = 0;
+}
+
+void reDFAInit(reDFA *d, reProg *prog) {
+    d->prog = prog;
+    d->states = malloc(sizeof(reState *) * KILO_RE_STATES);
+    d->trans = malloc(sizeof(int) * KILO_RE_STATES * 256);
+    d->table = calloc(KILO_RE_STATES * 2, sizeof(int));
+    d->stack = malloc(sizeof(int) * prog->n);
+    d->list = malloc(sizeof(int) * prog->n);
+    d->mark = calloc(prog->n, sizeof(unsigned int));
+    if (!d->states || !d->trans || !d->table || !d->stack || !d->list || !d->mark) die("malloc");
+    d->nstates = 0;
+    d->nlist = 0;
+    d->gen = 0;
+    d->start = -1;
+    d->flushes = 0;
+    d->anchored = 0;
+}
+
+void reDFAFlush(reDFA *d) {
+    int j;
+    for (j = 0; j < d->nstates; j++) {
+        free(d->states[j]->pcs);
+        free(d->states[j]);
+    }
+    d->nstates = 0;
+    memset(d->table, 0, sizeof(int) * KILO_RE_STATES * 2);
+    d->start = -1;
+    d->flushes++;
+}
+
+void reDFAFree(reDFA *d) {
+    reDFAFlush(d);
+    free(d->states);
+    free(d->trans);
+    free(d->table);
+    free(d->stack);
+    free(d->list);
+    free(d->mark);
+}
+
+void rePush(reDFA *d, int *sp, int pc) {
+    if (d->mark[pc] == d->gen) return;
+    d->mark[pc] = d->gen;
+    d->stack[(*sp)++] = pc;
+}
+
+// Add everything reachable from pc without reading a byte to the list.
+// End-of-row checks stay in the list, they are only passed at the end.
+void reClosure(reDFA *d, int pc, int bol) {
+    int sp = 0;
+    rePush(d, &sp, pc);
+    while (sp > 0) {
+        reInst *in = &d->prog->inst[d->stack[--sp]];
+        switch (in->op) {
+            case RE_SPLIT:
+                rePush(d, &sp, in->out1);
+                rePush(d, &sp, in->out);
+                break;
+            case RE_JMP:
+                rePush(d, &sp, in->out);
+                break;
+            case RE_BOL:
+                if (bol) rePush(d, &sp, in->out);
+                break;
+            default:
+                d->list[d->nlist++] = in - d->prog->inst;
+        }
+    }
+}
+
+// Whether a state holding the instructions in pcs matches at the end of
+// the row, once its end-of-row checks pass. In an empty row the end is
+// also the start, and bol says so.
+int reMatchesAtEnd(reDFA *d, int *pcs, int n, int bol) {
+    d->gen++;
+    int sp = 0;
+    int j;
+    for (j = 0; j < n; j++)
+        if (d->prog->inst[pcs[j]].op == RE_EOL) rePush(d, &sp, d->prog->inst[pcs[j]].out);
+    while (sp > 0) {
+        reInst *in = &d->prog->inst[d->stack[--sp]];
+        switch (in->op) {
+            case RE_MATCH:
+                return 1;
+            case RE_SPLIT:
+                rePush(d, &sp, in->out1);
+                rePush(d, &sp, in->out);
+                break;
+            case RE_JMP:
+            case RE_EOL:
+                rePush(d, &sp, in->out);
+                break;
+            case RE_BOL:
+                if (bol) rePush(d, &sp, in->out);
+                break;
+        }
+    }
+    return 0;
+}
+
+int reIntCmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// The state for the instructions in d->list, built if it is new.
+int reStateFor(reDFA *d) {
+    qsort(d->list, d->nlist, sizeof(int), reIntCmp);
+    unsigned int h = 2166136261u;
+    int j;
+    for (j = 0; j < d->nlist; j++) h = (h ^ d->list[j]) * 16777619u;
+
+    int mask = KILO_RE_STATES * 2 - 1;
+    int slot = h & mask;
+    while (d->table[slot]) {
+        reState *s = d->states[d->table[slot] - 1];
+        if (s->hash == h && s->n == d->nlist && memcmp(s->pcs, d->list, sizeof(int) * s->n) == 0)
+            return d->table[slot] - 1;
+        slot = (slot + 1) & mask;
+    }
+
+    if (d->nstates == KILO_RE_STATES) {
+        reDFAFlush(d);
+        slot = h & mask;
+    }
+    reState *s = malloc(sizeof(reState));
+    if (s == NULL) die("malloc");
+    s->pcs = malloc(sizeof(int) * (d->nlist ? d->nlist : 1));
+    if (s->pcs == NULL) die("malloc");
+    memcpy(s->pcs, d->list, sizeof(int) * d->nlist);
+    s->n = d->nlist;
+    s->hash = h;
+    for (j = 0; j < 256; j++) d->trans[(d->nstates << 8) | j] = -1;
+    s->match = 0;
+    for (j = 0; j < s->n; j++)
+        if (d->prog->inst[s->pcs[j]].op == RE_MATCH) s->match = 1;
+    s->endmatch = s->match || reMatchesAtEnd(d, s->pcs, s->n, 0);
+
+    d->states[d->nstates] = s;
+    d->table[slot] = ++d->nstates;
+    return d->nstates - 1;
+}
+
+int reStart(reDFA *d) {
+    if (d->start < 0) {
+        d->gen++;
+        d->nlist = 0;
+        reClosure(d, 0, 1);
+        int s = reStateFor(d);
+        d->start = s;
+        reState *st = d->states[s];
+        d->emptymatch = st->match || reMatchesAtEnd(d, st->pcs, st->n, 1);
+    }
+    return d->start;
+}
+
+// Build the transition from state si on c, coded as in d->trans. Unless
+// the DFA is anchored, every state also starts a new attempt at the
+// pattern, so a match can begin anywhere in the row.
+int reStep(reDFA *d, int si, int c) {
+    reState *s = d->states[si];
+
+    d->gen++;
+    d->nlist = 0;
+    int j;
+    for (j = 0; j < s->n; j++) {
+        reInst *in = &d->prog->inst[s->pcs[j]];
+        if (in->op == RE_BYTE && (in->cls[c >> 3] & (1 << (c & 7))))
+            reClosure(d, in->out, 0);
+    }
+    if (!d->anchored) reClosure(d, 0, 0);
+
+    int flushes = d->flushes;
+    int ni = reStateFor(d);
+    int x = ni << 1 | d->states[ni]->match;
+    if (d->flushes == flushes) d->trans[(si << 8) | c] = x;
+    return x;
+}
+
+// Whether the pattern matches anywhere in s.
+int reMatchRow(reDFA *d, const char *s, int len) {
+    int si = reStart(d);
+    if (len == 0) return d->emptymatch;
+    if (d->states[si]->match) return 1;
+    const int *trans = d->trans;
+    int j;
+    for (j = 0; j < len; j++) {
+        int c = (unsigned char)s[j];
+        int x = trans[(si << 8) | c];
+        if (x < 0) x = reStep(d, si, c);
+        if (x & 1) return 1;
+        si = x >> 1;
+    }
+    return d->states[si]->endmatch;
+}
+
+// Run the reversed program from the end of s back to its start, calling
+// found() for each column a match starts at, from right to left.
+void reRowStarts(reDFA *d, const char *s, int len, void (*found)(int col, void *arg), void *arg) {
+    int si = reStart(d);
+    if (len == 0 ? d->emptymatch : d->states[si]->match) found(len, arg);
+    int j;
+    for (j = len - 1; j >= 0; j--) {
+        int c = (unsigned char)s[j];
+        int x = d->trans[(si << 8) | c];
+        if (x < 0) x = reStep(d, si, c);
+        si = x >> 1;
+        if (j == 0 ? d->states[si]->endmatch : (x & 1)) found(j, arg);
+    }
+}
+
+// End of the longest match that starts at s[at], or -1 when none does.
+// d must be anchored.
+int reMatchEnd(reDFA *d, const char *s, int len, int at) {
+    d->gen++;
+    d->nlist = 0;
+    reClosure(d, 0, at == 0);
+    int si = reStateFor(d);
+    reState *st = d->states[si];
+    int end = -1;
+    if (st->match || (at == len && reMatchesAtEnd(d, st->pcs, st->n, at == 0))) end = at;
+    int j;
+    for (j = at; j < len && d->states[si]->n > 0; j++) {
+        int c = (unsigned char)s[j];
+        int x = d->trans[(si << 8) | c];
+        if (x < 0) x = reStep(d, si, c);
+        si = x >> 1;
+        if (j + 1 == len ? d->states[si]->endmatch : (x & 1)) end = j + 1;
+    }
+    return end;
+}
+
+/*** find ***/
+
+// Searching runs on threads of its own while the prompt is open, so the
+// screen stays live and the status bar can count matches as they are
+// found. Helper threads scan chunks of rows in parallel, and one more
+// thread collects their matches in file order. Every match is kept, and
+// moving to the next or previous one is just an index into that list.
+
+// Bytes of typical text and code, most common first; anything else counts
+// as rarer than all of them.
+static const char searchCommon[] = " etaoinsrhldcumfpgwybvkxjqz"
+    "ETAOINSRHLDCUMFPGWYBVKXJQZ_0123456789.,;()=\"'-*/{}[]<>:#!&|+\t";
+
+// Index of the byte of q least likely to appear in text. That is the one
+// memchr() looks for, so the rest of q is compared only rarely.
+int searchRareByte(const char *q, int qlen) {
+    int best = 0, bestrank = -1;
+    int j;
+    for (j = 0; j < qlen; j++) {
+        const char *p = strchr(searchCommon, q[j]);
+        int rank = p ? p - searchCommon : (int)sizeof(searchCommon);
+        if (rank > bestrank) {
+            bestrank = rank;
+            best = j;
+        }
+    }
+    return best;
+}
+
+// First occurrence of E.search.lit in h, or NULL.
+const char *searchMem(const char *h, size_t hlen) {
+    const char *q = E.search.lit;
+    size_t qlen = E.search.litlen;
+    int rare = E.search.rare;
+    if (hlen < qlen) return NULL;
+
+    const char *p = h + rare;
+    const char *end = h + (hlen - qlen) + rare + 1;
+    while (p < end && (p = memchr(p, q[rare], end - p)) != NULL) {
+        if (memcmp(p - rare, q, qlen) == 0) return p - rare;
+        p++;
+    }
+    return NULL;
+}
+
+// Text of row `at`, found without the lookup cache that only the main
+// thread may use. The caller holds E.search.buf->rope_lock.
+const char *searchRowText(int at, int *len) {
+    int start;
+    ropeNode *t = ropeLocate(E.search.buf->rope, at, &start);
+    if (t->rows) {
+        erow *row = &t->rows[at - start];
+        *len = row->size;
+        return row->chars;
+    }
+    size_t next;
+    size_t p = mapLineOffset(&E.search.buf->map, t->first + at - start);
+    *len = mapLineLength(&E.search.buf->map, p, &next);
+    return &E.search.buf->map.data[p];
+}
+
+void searchAdd(searchMatch **buf, int *n, int *cap, int row, int col) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        *buf = realloc(*buf, sizeof(searchMatch) * *cap);
+        if (*buf == NULL) die("realloc");
+    }
+    (*buf)[*n].row = row;
+    (*buf)[*n].col = col;
+    (*n)++;
+}
+
+// Append to the list the main thread sees. The caller holds E.search.lock.
+void searchAppend(searchMatch *m, int n) {
+    if (E.search.nmatches + n > E.search.cap) {
+        while (E.search.nmatches + n > E.search.cap) E.search.cap = E.search.cap ? E.search.cap * 2 : 256;
+        E.search.matches = realloc(E.search.matches, sizeof(searchMatch) * E.search.cap);
+        if (E.search.matches == NULL) die("realloc");
+    }
+    memcpy(&E.search.matches[E.search.nmatches], m, sizeof(searchMatch) * n);
+    E.search.nmatches += n;
+}
+
+// Hand matches found in rows before `scanned` over to the main thread.
+void searchPublish(searchMatch *buf, int n, int scanned) {
+    pthread_mutex_lock(&E.search.lock);
+    searchAppend(buf, n);
+    E.search.scanned = scanned;
+    pthread_mutex_unlock(&E.search.lock);
+    editorWake();
+}
+
+// What a scanning thread keeps to itself: the matches of its current
+// chunk, and for a regex a pair of DFAs, as those fill in while they run.
+typedef struct searchScanner {
+    searchMatch *buf;
+    int n;
+    int cap;
+    int row;
+    reDFA fwd;
+    reDFA rev;
+} searchScanner;
+
+void searchScannerInit(searchScanner *sc) {
+    sc->buf = NULL;
+    sc->n = sc->cap = 0;
+    if (E.search.regex) {
+        reDFAInit(&sc->fwd, &E.search.fwd);
+        reDFAInit(&sc->rev, &E.search.rev);
+    }
+}
+
+void searchScannerFree(searchScanner *sc) {
+    free(sc->buf);
+    if (E.search.regex) {
+        reDFAFree(&sc->fwd);
+        reDFAFree(&sc->rev);
+    }
+}
+
+void searchFoundStart(int col, void *arg) {
+    searchScanner *sc = arg;
+    searchAdd(&sc->buf, &sc->n, &sc->cap, sc->row, col);
+}
+
+void searchRow(searchScanner *sc, const char *s, int len, int row) {
+    if (!E.search.regex) {
+        const char *m;
+        int col = 0;
+        while ((m = searchMem(&s[col], len - col)) != NULL) {
+            col = m - s;
+            searchAdd(&sc->buf, &sc->n, &sc->cap, row, col);
+            if (E.search.firstonly) break;
+            col++;
+        }
+        return;
+    }
+
+    // Most rows do not match at all. Rows without the literal the pattern
+    // needs are skipped outright, the forward DFA rules out the rest in
+    // one pass, and for rows that do match the reversed one finds where
+    // matches start.
+    if (E.search.litlen > 0 && searchMem(s, len) == NULL) return;
+    if (!reMatchRow(&sc->fwd, s, len)) return;
+    int k = sc->n;
+    sc->row = row;
+    reRowStarts(&sc->rev, s, len, searchFoundStart, sc);
+    int i = k, j = sc->n - 1;
+    while (i < j) {
+        searchMatch tmp = sc->buf[i];
+        sc->buf[i++] = sc->buf[j];
+        sc->buf[j--] = tmp;
+    }
+    // A pattern that matches empty text matches at every column, only the
+    // first one is worth keeping.
+    if ((E.search.fwd.nullable || E.search.firstonly) && sc->n > k) sc->n = k + 1;
+}
+
+// Matches in rows [at, at + n) of a span, straight from the file mapping.
+// The literal is looked for in the whole span at once, lines are only
+// told apart where it occurs.
+void searchSpan(searchScanner *sc, ropeNode *t, int at, int start, int n) {
+    int line = t->first + at - start;
+    size_t p = mapLineOffset(&E.search.buf->map, line);
+    size_t end = line + n < E.search.buf->map.lines ? mapLineOffset(&E.search.buf->map, line + n) : E.search.buf->map.len;
+
+    if (E.search.litlen == 0) {
+        while (n-- > 0) {
+            size_t next;
+            int len = mapLineLength(&E.search.buf->map, p, &next);
+            searchRow(sc, &E.search.buf->map.data[p], len, at++);
+            p = next;
+        }
+        return;
+    }
+
+    size_t linestart = p;
+    const char *m;
+    while (p < end && (m = searchMem(&E.search.buf->map.data[p], end - p)) != NULL) {
+        size_t pos = m - E.search.buf->map.data;
+        char *nl;
+        while ((nl = memchr(&E.search.buf->map.data[linestart], '\n', pos - linestart)) != NULL) {
+            linestart = nl - E.search.buf->map.data + 1;
+            at++;
+        }
+        if (!E.search.regex) {
+            searchAdd(&sc->buf, &sc->n, &sc->cap, at, pos - linestart);
+            p = pos + 1;
+            if (E.search.firstonly) {
+                nl = memchr(&E.search.buf->map.data[pos], '\n', end - pos);
+                p = nl ? (size_t)(nl - E.search.buf->map.data) + 1 : end;
+            }
+        } else {
+            size_t next;
+            int len = mapLineLength(&E.search.buf->map, linestart, &next);
+            searchRow(sc, &E.search.buf->map.data[linestart], len, at++);
+            p = linestart = next;
+        }
+    }
+}
+
+void searchRows(searchScanner *sc, int at, int end) {
+    pthread_rwlock_rdlock(&E.search.buf->rope_lock);
+    while (at < end) {
+        int start;
+        ropeNode *t = ropeLocate(E.search.buf->rope, at, &start);
+        int stop = start + t->n < end ? start + t->n : end;
+        if (t->rows) {
+            for (; at < stop; at++) {
+                erow *row = &t->rows[at - start];
+                searchRow(sc, row->chars, row->size, at);
+            }
+        } else {
+            searchSpan(sc, t, at, start, stop - at);
+            at = stop;
+        }
+    }
+    pthread_rwlock_unlock(&E.search.buf->rope_lock);
+}
+
+void *searchHelper(void *arg) {
+    (void)arg;
+    searchScanner sc;
+    searchScannerInit(&sc);
+    while (1) {
+        pthread_mutex_lock(&E.search.lock);
+        int k = -1;
+        if (!E.search.stop && E.search.next < E.search.nchunks) k = E.search.next++;
+        pthread_mutex_unlock(&E.search.lock);
+        if (k == -1) break;
+
+        int at = E.search.from + k * KILO_SEARCH_BATCH;
+        int end = at + KILO_SEARCH_BATCH < E.search.buf->numrows ? at + KILO_SEARCH_BATCH : E.search.buf->numrows;
+        sc.buf = NULL;
+        sc.n = sc.cap = 0;
+        searchRows(&sc, at, end);
+
+        pthread_mutex_lock(&E.search.lock);
+        E.search.chunks[k].m = sc.buf;
+        E.search.chunks[k].n = sc.n;
+        E.search.chunks[k].ready = 1;
+        pthread_cond_broadcast(&E.search.cond);
+        pthread_mutex_unlock(&E.search.lock);
+        sc.buf = NULL;
+    }
+    searchScannerFree(&sc);
+    perfMerge();
+    return NULL;
+}
+
+void *searchWorker(void *arg) {
+    (void)arg;
+    searchMatch *buf = NULL;
+    int nbuf = 0, cap = 0;
+
+    // A longer query can only match where the one before it did, so when
+    // the query grew its earlier matches are checked instead of the rows.
+    int k = 0;
+    while (k < E.search.ncand && !E.search.stop) {
+        pthread_rwlock_rdlock(&E.search.buf->rope_lock);
+        int stop = k + KILO_SEARCH_BATCH;
+        while (k < E.search.ncand && (k < stop || E.search.cand[k].row == E.search.cand[k - 1].row)) {
+            searchMatch *c = &E.search.cand[k++];
+            int len;
+            const char *s = searchRowText(c->row, &len);
+            if (c->col + E.search.qlen <= len && memcmp(&s[c->col], E.search.query, E.search.qlen) == 0)
+                searchAdd(&buf, &nbuf, &cap, c->row, c->col);
+        }
+        pthread_rwlock_unlock(&E.search.buf->rope_lock);
+        searchPublish(buf, nbuf, k < E.search.ncand ? E.search.cand[k].row : E.search.from);
+        nbuf = 0;
+    }
+    free(buf);
+
+    // The rest of the rows go to the helpers in chunks, whose matches are
+    // handed on in order as each chunk is done.
+    E.search.nchunks = (E.search.buf->numrows - E.search.from + KILO_SEARCH_BATCH - 1) / KILO_SEARCH_BATCH;
+    if (E.search.nchunks < 0) E.search.nchunks = 0;
+    E.search.chunks = calloc(E.search.nchunks + 1, sizeof(searchChunk));
+    if (E.search.chunks == NULL) die("calloc");
+    E.search.next = 0;
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    if (ncpu > KILO_SEARCH_THREADS) ncpu = KILO_SEARCH_THREADS;
+    if (ncpu > E.search.nchunks) ncpu = E.search.nchunks;
+    pthread_t helpers[KILO_SEARCH_THREADS];
+    int nhelpers = 0;
+    while (nhelpers < ncpu && pthread_create(&helpers[nhelpers], NULL, searchHelper, NULL) == 0)
+        nhelpers++;
+    if (nhelpers == 0) searchHelper(NULL);
+
+    for (k = 0; k < E.search.nchunks; k++) {
+        searchChunk *c = &E.search.chunks[k];
+        pthread_mutex_lock(&E.search.lock);
+        while (!c->ready && !E.search.stop) pthread_cond_wait(&E.search.cond, &E.search.lock);
+        if (!c->ready) {
+            pthread_mutex_unlock(&E.search.lock);
+            break;
+        }
+        searchAppend(c->m, c->n);
+        E.search.scanned = E.search.from + (k + 1) * KILO_SEARCH_BATCH;
+        if (E.search.scanned > E.search.buf->numrows) E.search.scanned = E.search.buf->numrows;
+        pthread_mutex_unlock(&E.search.lock);
+        free(c->m);
+        c->m = NULL;
+        editorWake();
+    }
+
+    while (nhelpers > 0) pthread_join(helpers[--nhelpers], NULL);
+    for (k = 0; k < E.search.nchunks; k++) free(E.search.chunks[k].m);
+    free(E.search.chunks);
+    E.search.chunks = NULL;
+
+    pthread_mutex_lock(&E.search.lock);
+    E.search.done = !E.search.stop;
+    pthread_mutex_unlock(&E.search.lock);
+    editorWake();
+    perfMerge();
+    return NULL;
+}
+
+void editorSearchStop() {
+    if (!E.search.running) return;
+    pthread_mutex_lock(&E.search.lock);
+    E.search.stop = 1;
+    pthread_cond_broadcast(&E.search.cond);
+    pthread_mutex_unlock(&E.search.lock);
+    pthread_join(E.search.thread, NULL);
+    E.search.running = 0;
+    free(E.search.cand);
+    E.search.cand = NULL;
+    E.search.ncand = 0;
+}
+
+// Let the search run to the end, for when every match is needed.
+void editorSearchWait() {
+    if (!E.search.running) return;
+    pthread_join(E.search.thread, NULL);
+    E.search.running = 0;
+    free(E.search.cand);
+    E.search.cand = NULL;
+    E.search.ncand = 0;
+}
+
+void editorSearchStart(const char *query) {
+    editorSearchStop();
+
+    int qlen = strlen(query);
+    // With only the first match of each row kept, a row whose first match
+    // of the shorter query does not go on to the longer one may still
+    // match it further on.
+    int narrow = !E.search.regex && !E.search.firstonly && E.search.qlen > 0 && qlen > E.search.qlen &&
+        memcmp(query, E.search.query, E.search.qlen) == 0;
+    if (narrow) {
+        E.search.cand = E.search.matches;
+        E.search.ncand = E.search.nmatches;
+        E.search.from = E.search.scanned;
+    } else {
+        free(E.search.matches);
+        E.search.from = 0;
+    }
+    E.search.matches = NULL;
+    E.search.nmatches = 0;
+    E.search.cap = 0;
+    E.search.scanned = 0;
+    E.search.current = -1;
+    E.search.stop = 0;
+
+    free(E.search.query);
+    E.search.query = strdup(query);
+    E.search.qlen = qlen;
+    E.search.lit = E.search.query;
+    E.search.litlen = qlen;
+    E.search.done = qlen == 0;
+    reProgFree(&E.search.fwd);
+    reProgFree(&E.search.rev);
+    E.search.error = NULL;
+    if (qlen > 0 && E.search.regex) {
+        E.search.error = reCompile(query, &E.search.fwd, &E.search.rev);
+        if (E.search.error) E.search.done = 1;
+        E.search.lit = E.search.must;
+        E.search.litlen = reMustLiteral(query, E.search.must);
+    }
+    E.search.rare = searchRareByte(E.search.lit, E.search.litlen);
+    if (E.search.done) {
+        free(E.search.cand);
+        E.search.cand = NULL;
+        E.search.ncand = 0;
+        return;
+    }
+
+    E.search.buf = E.buf;
+    if (pthread_create(&E.search.thread, NULL, searchWorker, NULL) != 0) die("pthread_create");
+    E.search.running = 1;
+}
+
+void editorSearchEnd() {
+    editorSearchStop();
+    free(E.search.query);
+    free(E.search.matches);
+    reProgFree(&E.search.fwd);
+    reProgFree(&E.search.rev);
+    E.search.query = NULL;
+    E.search.qlen = 0;
+    E.search.matches = NULL;
+    E.search.nmatches = 0;
+    E.search.cap = 0;
+    E.search.error = NULL;
+    E.search.active = 0;
+}
+
+// Put the cursor on match k, which must already have been found.
+void editorSearchJump(int k) {
+    pthread_mutex_lock(&E.search.lock);
+    searchMatch m = E.search.matches[k];
+    pthread_mutex_unlock(&E.search.lock);
+    E.search.current = k;
+    E.win->cy = m.row;
+    E.win->cx = m.col;
+    // editorScroll() then brings the match to the top of the screen.
+    E.win->rowoff = E.buf->numrows;
+}
+
+// Called by the event loop: go to the first match once there is one, and
+// tell whether the match count on screen is out of date.
+int editorSearchPoll() {
+    if (!E.search.active) return 0;
+    pthread_mutex_lock(&E.search.lock);
+    int n = E.search.nmatches;
+    int done = E.search.done;
+    pthread_mutex_unlock(&E.search.lock);
+    if (E.search.current == -1 && n > 0) editorSearchJump(0);
+    int shown = n * 2 + done;
+    if (shown == E.search.shown) return 0;
+    E.search.shown = shown;
+    return 1;
+}
+
+void editorFindCallback(char *query, int key) {
+    if (key == '\r' || key == '\x1b') {
+        return;
+    }
+
+    pthread_mutex_lock(&E.search.lock);
+    int n = E.search.nmatches;
+    pthread_mutex_unlock(&E.search.lock);
+
+    if (key == CTRL_KEY('r')) {
+        // Switch between literal and regex search, the same text is
+        // searched again either way.
+        E.search.regex = !E.search.regex;
+        editorSearchStop();
+        free(E.search.query);
+        E.search.query = NULL;
+        E.search.qlen = 0;
+        editorSearchStart(query);
+        editorSearchPoll();
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        if (n > 0) editorSearchJump((E.search.current + 1) % n);
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        if (n > 0) editorSearchJump(E.search.current <= 0 ? n - 1 : E.search.current - 1);
+    } else if (E.search.query == NULL || strcmp(query, E.search.query) != 0) {
+        editorSearchStart(query);
+        editorSearchPoll();
+    }
+}
+
+void editorFind() {
+    editorIndexAll();
+
+    int saved_cx = E.win->cx;
+    int saved_cy = E.win->cy;
+    int saved_coloff = E.win->coloff;
+    int saved_rowoff = E.win->rowoff;
+    int saved_rowsub = E.win->rowsub;
+
+    E.search.active = 1;
+    E.search.shown = -1;
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R regex)", editorFindCallback, 0);
+    editorSearchEnd();
+
+    if (query) {
+        free(query);
+    } else {
+        E.win->cx = saved_cx;
+        E.win->cy = saved_cy;
+        E.win->coloff = saved_coloff;
+        E.win->rowoff = saved_rowoff;
+        E.win->rowsub = saved_rowsub;
+    }
+}
+
+// Replace every match of the finished search with `with`, and return how
+// many were replaced. A row is rewritten once whatever its number of
+// matches: what lies between its first match and the end of its last is
+// logged as deleted and the new text as inserted, so undo puts the row
+// back with two records, and all of it is one undo step.
+int editorReplaceAll(const char *with, int *undoable) {
+    int wlen = strlen(with);
+    reDFA d;
+    if (E.search.regex) {
+        reDFAInit(&d, &E.search.fwd);
+        d.anchored = 1;
+    }
+    char *text = NULL;
+    int textcap = 0;
+    int replaced = 0, first = -1, last = -1;
+
+    editorUndoBegin();
+    int k = 0;
+    while (k < E.search.nmatches) {
+        int at = E.search.matches[k].row;
+        erow *row = editorRowAt(at);
+        int from = -1, end = 0, n = 0;
+        for (; k < E.search.nmatches && E.search.matches[k].row == at; k++) {
+            int start = E.search.matches[k].col;
+            // Literal matches may overlap; only the first of those goes.
+            if (start < end) continue;
+            int stop = E.search.regex ? reMatchEnd(&d, row->chars, row->size, start) : start + E.search.qlen;
+            if (stop < 0) continue;
+            int gap = from == -1 ? 0 : start - end;
+            if (text == NULL || n + gap + wlen > textcap) {
+                if (textcap == 0) textcap = 256;
+                while (n + gap + wlen > textcap) textcap *= 2;
+                text = realloc(text, textcap);
+                if (text == NULL) die("realloc");
+            }
+            if (from == -1) from = start;
+            memcpy(&text[n], &row->chars[end], gap);
+            memcpy(&text[n + gap], with, wlen);
+            n += gap + wlen;
+            end = stop;
+            replaced++;
+        }
+        if (from == -1) continue;
+
+        undoAdd(UNDO_DELETE, 0, at, from, at, end, &row->chars[from], end - from);
+        undoAdd(UNDO_INSERT, 0, at, from, at, from + n, text, n);
+        int tail = row->size - end;
+        int size = from + n + tail;
+        editorRowReserve(row, size > row->size ? size : row->size);
+        memmove(&row->chars[from + n], &row->chars[end], tail);
+        memcpy(&row->chars[from], text, n);
+        row->size = size;
+        row->chars[size] = '\0';
+        editorUpdateRow(row, from);
+        if (first == -1) first = at;
+        last = at;
+    }
+    *undoable = !E.buf->undo.dropped;
+    editorUndoEnd();
+
+    if (first != -1) {
+        E.buf->dirty++;
+        editorMarkDirty(first, last - first + 1, last - first + 1);
+    }
+    free(text);
+    if (E.search.regex) reDFAFree(&d);
+    return replaced;
+}
+
+// Ctrl-R: the pattern is looked for as the find prompt does, then every
+// match is replaced at once.
+void editorReplace() {
+    editorIndexAll();
+
+    int saved_cx = E.win->cx;
+    int saved_cy = E.win->cy;
+    int saved_coloff = E.win->coloff;
+    int saved_rowoff = E.win->rowoff;
+    int saved_rowsub = E.win->rowsub;
+
+    E.search.active = 1;
+    E.search.shown = -1;
+    char *query = editorPrompt("Replace: %s (Use ESC/Arrows/Enter, Ctrl-R regex)", editorFindCallback, 0);
+    char *with = query ? editorPrompt("Replace with: %s (ESC to cancel)", NULL, 1) : NULL;
+    if (with) {
+        editorSearchWait();
+        if (E.search.error) {
+            editorSetStatusMessage("Bad pattern: %s", E.search.error);
+        } else {
+            int undoable;
+            int n = editorReplaceAll(with, &undoable);
+            if (n && !undoable) editorSetStatusMessage("Replaced %d matches, too many to undo", n);
+            else if (n) editorSetStatusMessage("Replaced %d match%s", n, n == 1 ? "" : "es");
+            else editorSetStatusMessage("No matches");
+        }
+    }
+    editorSearchEnd();
+    free(query);
+    free(with);
+
+    E.win->cx = saved_cx;
+    E.win->cy = saved_cy;
+    E.win->coloff = saved_coloff;
+    E.win->rowoff = saved_rowoff;
+    E.win->rowsub = saved_rowsub;
+}
+
+/*** filter ***/
+
+// Ctrl-G hides every row that does not match a query, as less does with
+// &pattern, and the rows shown can still be edited. The view is a sorted
+// vector of row numbers found by the search threads, so it costs an int
+// per matching row and no copy of any text. Edits only test the rows they
+// change, and move the numbers of the rows after them.
+
+// Index in f->rows of the first row at or after `row`.
+int filterIndex(viewFilter *f, int row) {
+    int lo = 0, hi = f->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (f->rows[mid] < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int filterMatch(viewFilter *f, const char *s, int len) {
+    if (f->regex) return reMatchRow(&f->dfa, s, len);
+    int qlen = strlen(f->query);
+    if (len < qlen) return 0;
+    const char *p = s, *end = s + len - qlen + 1;
+    while (p < end && (p = memchr(p, f->query[0], end - p)) != NULL) {
+        if (memcmp(p, f->query, qlen) == 0) return 1;
+        p++;
+    }
+    return 0;
+}
+
+// Lines of the current window's view, with the cursor's row among them.
+int filterLines() {
+    viewFilter *f = E.win->filter;
+    int k = filterIndex(f, E.win->cy);
+    return f->n + (k == f->n || f->rows[k] != E.win->cy);
+}
+
+// The row on line k of the view, which must be below filterLines().
+int filterRow(int k) {
+    viewFilter *f = E.win->filter;
+    int c = filterIndex(f, E.win->cy);
+    if (k < c || (c < f->n && f->rows[c] == E.win->cy)) return f->rows[k];
+    return k == c ? E.win->cy : f->rows[k - 1];
+}
+
+// The row d lines above (d < 0) or below the cursor's in the view, or -1.
+int filterStep(int d) {
+    int k = filterIndex(E.win->filter, E.win->cy) + d;
+    return k >= 0 && k < filterLines() ? filterRow(k) : -1;
+}
+
+// Rows at .. at + removed - 1 of the current buffer became `added` rows:
+// test those again for every view of the buffer, and move the rows after.
+void filterEdit(int at, int removed, int added) {
+    struct editorWindow *w;
+    for (w = E.windows; w; w = w->next) {
+        viewFilter *f = w->filter;
+        if (f == NULL || w->buf != E.buf) continue;
+        int lo = filterIndex(f, at), hi = filterIndex(f, at + removed);
+        int tail = f->n - hi;
+        if (lo + added + tail > f->cap) {
+            while (lo + added + tail > f->cap) f->cap = f->cap ? f->cap * 2 : 256;
+            f->rows = realloc(f->rows, sizeof(int) * f->cap);
+            if (f->rows == NULL) die("realloc");
+        }
+        // The tail makes room for all the new rows first, and closes up
+        // behind the ones that match.
+        if (lo + added != hi) memmove(&f->rows[lo + added], &f->rows[hi], sizeof(int) * tail);
+        int n = lo;
+        rowIter it;
+        const char *text;
+        int len;
+        rowIterInit(&it, at);
+        while (it.at < at + added && rowIterNext(&it, &text, &len)) {
+            if (filterMatch(f, text, len)) f->rows[n++] = it.at - 1;
+        }
+        if (n != lo + added) memmove(&f->rows[n], &f->rows[lo + added], sizeof(int) * tail);
+        if (added != removed) {
+            int j;
+            for (j = n; j < n + tail; j++) f->rows[j] += added - removed;
+        }
+        f->n = n + tail;
+    }
+}
+
+void filterFree(struct editorWindow *w) {
+    viewFilter *f = w->filter;
+    if (f == NULL) return;
+    if (f->regex) reDFAFree(&f->dfa);
+    reProgFree(&f->fwd);
+    reProgFree(&f->rev);
+    free(f->query);
+    free(f->rows);
+    // The cursor stays on the same line of the window.
+    w->rowoff = w->cy - (filterIndex(f, w->cy) - w->rowoff);
+    if (w->rowoff < 0) w->rowoff = 0;
+    w->wrap = f->wrap;
+    w->filter = NULL;
+    w->shadow_top = -1;
+    free(f);
+}
+
+// Make the finished search for query the current window's view.
+void filterSet(const char *query) {
+    viewFilter *f = calloc(1, sizeof(viewFilter));
+    if (f == NULL) die("calloc");
+    f->query = strdup(query);
+    f->regex = E.search.regex;
+    if (f->regex) {
+        reCompile(query, &f->fwd, &f->rev);
+        reDFAInit(&f->dfa, &f->fwd);
+    }
+    // The search kept one match per row, in order.
+    f->n = f->cap = E.search.nmatches;
+    f->rows = malloc(sizeof(int) * (f->cap ? f->cap : 1));
+    if (f->rows == NULL) die("malloc");
+    int j;
+    for (j = 0; j < f->n; j++) f->rows[j] = E.search.matches[j].row;
+
+    filterFree(E.win);
+    int line = E.win->cy - E.win->rowoff;
+    f->wrap = E.win->wrap;
+    E.win->wrap = 0;
+    E.win->rowsub = 0;
+    E.win->filter = f;
+    E.win->rowoff = filterIndex(f, E.win->cy) - (line > 0 ? line : 0);
+    if (E.win->rowoff < 0) E.win->rowoff = 0;
+    E.win->shadow_top = -1;
+}
+
+// Ctrl-G: show only the rows matching a query, found as the find prompt
+// finds them; an empty query shows every row again.
+void editorFilter() {
+    editorIndexAll();
+
+    int saved_cx = E.win->cx;
+    int saved_cy = E.win->cy;
+    int saved_coloff = E.win->coloff;
+    int saved_rowoff = E.win->rowoff;
+
+    E.search.active = 1;
+    E.search.shown = -1;
+    E.search.firstonly = 1;
+    char *query = editorPrompt("Filter: %s (ESC to cancel, empty for all rows, Ctrl-R regex)", editorFindCallback, 1);
+    if (query && query[0] == '\0') {
+        filterFree(E.win);
+    } else if (query) {
+        editorSearchWait();
+        if (E.search.error) {
+            editorSetStatusMessage("Bad pattern: %s", E.search.error);
+        } else {
+            filterSet(query);
+            editorSetStatusMessage("%d rows match", E.win->filter->n);
+        }
+    } else {
+        E.win->cx = saved_cx;
+        E.win->cy = saved_cy;
+        E.win->coloff = saved_coloff;
+        E.win->rowoff = saved_rowoff;
+    }
+    editorSearchEnd();
+    E.search.firstonly = 0;
+    free(query);
+}
+
+/*** append buffer ***/
+
+struct abuf
+{
+    char *b;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+// Make room for n more bytes and return where they go. Capacity doubles,
+// so building a frame costs a few reallocs at most, and none once the
+// buffer is reused for the following frames.
+char *abReserve(struct abuf *ab, int n) {
+    if (ab->len + n > ab->cap) {
+        int cap = ab->cap ? ab->cap : 1024;
+        while (cap < ab->len + n) cap *= 2;
+        // realloc() and free() come from <stdlib.h>.
+        char *new = realloc(ab->b, cap);
+        if (new == NULL) return NULL;
+        ab->b = new;
+        ab->cap = cap;
+    }
+    return &ab->b[ab->len];
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+    char *p = abReserve(ab, len);
+    if (p == NULL) return;
+    // memcpy() comes from <string.h>.
+    memcpy(p, s, len);
+    ab->len += len;
+}
+
+void abAppendRepeat(struct abuf *ab, char c, int n) {
+    char *p = abReserve(ab, n);
+    if (p == NULL) return;
+    memset(p, c, n);
+    ab->len += n;
+}
+
+// Write out and empty the buffer, however many write() calls fd needs to
+// take all of it.
+int abFlush(struct abuf *ab, int fd) {
+    int off = 0;
+    while (off < ab->len) {
+        ssize_t n = write(fd, &ab->b[off], ab->len - off);
+        perf.flush_writes++;
+        if (n > 0) {
+            off += n;
+            perf.flush_bytes += n;
+        } else if (n == -1 && errno == EAGAIN) {
+            // poll() and struct pollfd come from <poll.h>.
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+        } else if (n == -1 && errno != EINTR) {
+            return -1;
+        }
+    }
+    ab->len = 0;
+    return 0;
+}
+
+void abFree(struct abuf *ab) {
+    free(ab->b);
+}
+
+/*** screen ***/
+
+// Frames are composed into E.screen, one cell per terminal column, and
+// only what differs from the previous frame (kept in E.shadow) is sent.
+// Lines and columns given to the functions that draw are those of the
+// region set by screenRegion(), a window or the message bar, and drawing
+// stops at its right edge.
+
+void screenRegion(int top, int left, int cols) {
+    E.clip_top = top;
+    E.clip_left = left;
+    E.clip_cols = cols;
+}
+
+screenCell *screenLine(int y) {
+    return &E.screen[(E.clip_top + y) * E.screen_cols + E.clip_left];
+}
+
+// Make sure the frame buffers match the terminal size. A fresh shadow
+// means the next flush starts from a cleared terminal.
+void screenEnsure() {
+    int lines = E.termrows;
+    if (E.screen && E.screen_lines == lines && E.screen_cols == E.termcols) return;
+    free(E.screen);
+    free(E.shadow);
+    E.screen = malloc(sizeof(screenCell) * lines * E.termcols);
+    E.shadow = malloc(sizeof(screenCell) * lines * E.termcols);
+    if (E.screen == NULL || E.shadow == NULL) die("malloc");
+    E.screen_lines = lines;
+    E.screen_cols = E.termcols;
+    E.shadow_valid = 0;
+}
+
+// Make the cell show the n bytes at s, or continue the wide character in
+// the cell before it when n is 0.
+void screenSetCell(screenCell *c, const char *s, int n, unsigned char attr, unsigned char hl) {
+    memset(c->ch, 0, sizeof(c->ch));
+    memcpy(c->ch, s, n);
+    c->len = n;
+    c->attr = attr;
+    c->hl = hl;
+}
+
+void screenBlank(screenCell *line, int n) {
+    int x;
+    for (x = 0; x < n; x++) screenSetCell(&line[x], " ", 1, 0, HL_NORMAL);
+}
+
+void screenClearLine(int y) {
+    screenBlank(screenLine(y), E.clip_cols);
+}
+
+// Put the character s[0 .. n - 1], `width` columns wide, at column x of
+// line y. A wide character that does not fit before the right edge shows
+// as spaces. Returns the column after it.
+int screenPutChar(int y, int x, const char *s, int n, int width, unsigned char attr, unsigned char hl) {
+    screenCell *line = screenLine(y);
+    if (width == 0) {
+        // A combining mark with nothing to combine with gets a space.
+        char buf[sizeof(line->ch)];
+        buf[0] = ' ';
+        if (n > (int)sizeof(buf) - 1) n = sizeof(buf) - 1;
+        memcpy(&buf[1], s, n);
+        return screenPutChar(y, x, buf, n + 1, 1, attr, hl);
+    }
+    if (x + width > E.clip_cols) {
+        while (x < E.clip_cols) screenSetCell(&line[x++], " ", 1, attr, hl);
+        return x;
+    }
+    if (n > (int)sizeof(line->ch)) {
+        // Drop the combining marks that do not fit, not half of one.
+        n = sizeof(line->ch);
+        while (n > 0 && (s[n] & 0xc0) == 0x80) n--;
+    }
+    screenSetCell(&line[x], s, n, attr, hl);
+    int k;
+    for (k = 1; k < width; k++) screenSetCell(&line[x + k], NULL, 0, attr, hl);
+    return x + width;
+}
+
+// Write len bytes of UTF-8 at column x of line y, clipped to the screen.
+// Returns the column after the last one written.
+int screenPut(int y, int x, const char *s, int len, unsigned char attr) {
+    int j = 0;
+    while (j < len && x < E.clip_cols) {
+        int width;
+        int n = utf8Char(&s[j], len - j, &width);
+        if (n == 1 && (unsigned char)s[j] >= 0x80) x = screenPutChar(y, x, "\xef\xbf\xbd", 3, 1, attr, HL_NORMAL);
+        else x = screenPutChar(y, x, &s[j], n, width, attr, HL_NORMAL);
+        j += n;
+    }
+    return x;
+}
+
+// Like screenPut() for a rendered row, with the highlight class of every
+// byte in hl.
+int screenPutHl(int y, int x, const char *s, const unsigned char *hl, int len) {
+    int j = 0;
+    while (j < len && x < E.clip_cols) {
+        int width;
+        int n = utf8Char(&s[j], len - j, &width);
+        x = screenPutChar(y, x, &s[j], n, width, 0, hl[j]);
+        j += n;
+    }
+    return x;
+}
+
+int screenFill(int y, int x, char c, int n, unsigned char attr) {
+    screenCell *line = screenLine(y);
+    while (n-- > 0 && x < E.clip_cols) screenSetCell(&line[x++], &c, 1, attr, HL_NORMAL);
+    return x;
+}
+
+int screenCellEqual(screenCell *a, screenCell *b) {
+    return memcmp(a, b, sizeof(screenCell)) == 0;
+}
+
+int screenCellSpace(const screenCell *c) {
+    return c->len == 1 && c->ch[0] == ' ';
+}
+
+int screenCellBlank(screenCell *c) {
+    return screenCellSpace(c) && c->attr == 0 && c->hl == HL_NORMAL;
+}
+
+// Switch the terminal from the attributes in cur to those of c, sending
+// only what changed. A space shows no foreground color, so drawing one
+// keeps the current color instead of switching back and forth.
+void screenSetAttr(struct abuf *ab, screenCell *cur, const screenCell *c) {
+    int color = cur->hl != c->hl && !screenCellSpace(c);
+    if (cur->attr == c->attr && !color) return;
+    char buf[32];
+    int len;
+    if (c->attr == 0 && c->hl == HL_NORMAL && (color || cur->hl == HL_NORMAL)) {
+        len = snprintf(buf, sizeof(buf), "\x1b[m");
+        color = 1;
+    } else {
+        len = snprintf(buf, sizeof(buf), "\x1b[");
+        if (cur->attr != c->attr)
+            len += snprintf(&buf[len], sizeof(buf) - len, "%s;",
+                (c->attr & CELL_REVERSE) ? "7" : "27");
+        if (color) {
+            len += editorSyntaxToColor(c->hl, &buf[len]);
+            len++;
+        }
+        buf[len - 1] = 'm';
+    }
+    abAppend(ab, buf, len);
+    cur->attr = c->attr;
+    if (color) cur->hl = c->hl;
+}
+
+// Shift the shadow frame's lines top .. top + rows - 1 by d lines (d > 0
+// scrolls the content up) the same way the terminal just did.
+void screenScrollShadow(int top, int rows, int d) {
+    int cols = E.screen_cols;
+    screenCell *area = &E.shadow[top * cols];
+    int keep = rows - (d > 0 ? d : -d);
+    if (d > 0) {
+        memmove(area, &area[d * cols], sizeof(screenCell) * keep * cols);
+        screenBlank(&area[keep * cols], (rows - keep) * cols);
+    } else {
+        memmove(&area[-d * cols], area, sizeof(screenCell) * keep * cols);
+        screenBlank(area, -d * cols);
+    }
+}
+
+// Let the terminal scroll the text of windows that moved by a few lines,
+// so only the lines that came into view are sent. That takes a scrolling
+// region, which spans whole lines: only windows as wide as the screen
+// can. Returns whether anything was sent.
+int screenScrollWindows(struct abuf *ab) {
+    struct editorWindow *cur = E.win;
+    struct editorWindow *w;
+    int sent = 0;
+    for (w = E.windows; w; w = w->next) {
+        editorUseWindow(w);
+        int top = editorTopLine();
+        int d = top - w->shadow_top;
+        if (w->shadow_top != -1 && d != 0 && abs(d) < w->screenrows &&
+            w->coloff == w->shadow_coloff && w->left == 0 && w->screencols == E.screen_cols) {
+            char buf[48];
+            int len = snprintf(buf, sizeof(buf), "%s\x1b[%d;%dr\x1b[%d%c",
+                sent ? "" : "\x1b[?25l\x1b[m", w->top + 1, w->top + w->screenrows,
+                d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+            abAppend(ab, buf, len);
+            screenScrollShadow(w->top, w->screenrows, d);
+            sent = 1;
+        }
+        w->shadow_top = top;
+        w->shadow_coloff = w->coloff;
+    }
+    editorUseWindow(cur);
+    if (sent) abAppend(ab, "\x1b[r", 3);
+    return sent;
+}
+
+// Append to ab what turns the shadow frame into E.screen, then make
+// E.screen the new shadow.
+void screenFlush(struct abuf *ab, int cy, int cx) {
+    int cols = E.screen_cols;
+    int y, x;
+    char buf[32];
+    screenCell plain;
+    screenSetCell(&plain, " ", 1, 0, HL_NORMAL);
+    screenCell attr = plain;
+    int ty = -1, tx = -1;   // terminal cursor, -1 when not known
+    int hidden = 0;
+
+    if (!E.shadow_valid) {
+        abAppend(ab, "\x1b[?25l\x1b[m\x1b[2J", 13);
+        hidden = 1;
+        screenBlank(E.shadow, E.screen_lines * cols);
+        E.shadow_valid = 1;
+        struct editorWindow *w;
+        for (w = E.windows; w; w = w->next) w->shadow_top = -1;
+    }
+    if (screenScrollWindows(ab)) hidden = 1;
+
+    for (y = 0; y < E.screen_lines; y++) {
+        screenCell *next = &E.screen[y * cols];
+        screenCell *prev = &E.shadow[y * cols];
+        if (memcmp(next, prev, sizeof(screenCell) * cols) == 0) continue;
+
+        // Everything from column nlen on is blank in the new frame.
+        int nlen = cols;
+        while (nlen > 0 && screenCellBlank(&next[nlen - 1])) nlen--;
+
+        x = 0;
+        while (x < cols) {
+            if (screenCellEqual(&next[x], &prev[x])) {
+                x++;
+                continue;
+            }
+            // A wide character is sent whole.
+            while (x > 0 && next[x].len == 0) x--;
+
+            // Grow the span over short runs of equal cells: resending them
+            // is cheaper than another cursor move.
+            int end = x, j;
+            for (j = x + 1; j < cols && j - end <= KILO_SPAN_GAP; j++) {
+                if (!screenCellEqual(&next[j], &prev[j])) end = j;
+            }
+
+            if (!hidden) {
+                abAppend(ab, "\x1b[?25l", 6);
+                hidden = 1;
+            }
+            if (ty != y || tx != x) {
+                int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+                abAppend(ab, buf, len);
+            }
+
+            int stop = end < nlen ? end + 1 : nlen;
+            while (stop < cols && next[stop].len == 0) stop++;
+            for (j = x; j < stop; ) {
+                int run = 1;
+                while (j + run < stop && screenCellEqual(&next[j + run], &next[j])) run++;
+                if (next[j].len == 0) {
+                    // The rest of a wide character, already sent.
+                    j += run;
+                    continue;
+                }
+                screenSetAttr(ab, &attr, &next[j]);
+                if (run >= KILO_ERASE_MIN && screenCellBlank(&next[j])) {
+                    int len = snprintf(buf, sizeof(buf), "\x1b[%dX\x1b[%dC", run, run);
+                    abAppend(ab, buf, len);
+                } else if (next[j].len == 1) {
+                    abAppendRepeat(ab, next[j].ch[0], run);
+                } else {
+                    int k;
+                    for (k = 0; k < run; k++) abAppend(ab, next[j].ch, next[j].len);
+                }
+                j += run;
+            }
+            if (end >= nlen) {
+                // The rest of the line is blank: erase it in one go.
+                screenSetAttr(ab, &attr, &plain);
+                abAppend(ab, "\x1b[K", 3);
+                ty = -1;
+                break;
+            }
+            ty = y;
+            tx = stop < cols ? stop : -1;
+            x = stop;
+        }
     }
-    return cx;
-}
+    // The next frame starts from plain text again.
+    if (attr.attr || attr.hl) abAppend(ab, "\x1b[m", 3);
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
-    int j = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') tabs++;
+    if (ty != cy || tx != cx) {
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
+        abAppend(ab, buf, len);
     }
+    if (hidden) abAppend(ab, "\x1b[?25h", 6);
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
-
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
-    }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    screenCell *t = E.shadow;
+    E.shadow = E.screen;
+    E.screen = t;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+/*** windows ***/
 
-    // int at = E.numrows;
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+// Every open file has a buffer, and windows showing buffers tile the
+// screen above the message bar. The rest of the editor works on E.win and
+// its buffer E.buf, which are the focused window outside of drawing.
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+struct editorBuffer *editorNewBuffer() {
+    struct editorBuffer *b = calloc(1, sizeof(struct editorBuffer));
+    if (b == NULL) die("malloc");
+    b->save_lo = -1;
+    b->notify_wd = -1;
+    b->map.done = 1;
+    b->hl.lo = -1;
+    b->undo.sealed = 1;
+    pthread_mutex_init(&b->map.lock, NULL);
+    pthread_cond_init(&b->map.cond, NULL);
+    pthread_rwlock_init(&b->rope_lock, NULL);
+    pthread_mutex_init(&b->journal.lock, NULL);
+    pthread_cond_init(&b->journal.cond, NULL);
 
-    E.numrows++;
-    E.dirty++;
+    struct editorBuffer **p = &E.buffers;
+    while (*p) p = &(*p)->next;
+    *p = b;
+    return b;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
+// A buffer no window shows keeps its rows but not their renderings; rows
+// still naming a dropped slot find it gone and render again when shown.
+void editorDropRenders(struct editorBuffer *b) {
+    int j;
+    for (j = 0; j < b->nrcache; j++) {
+        free(b->rcache[j].render);
+        free(b->rcache[j].marks);
+        free(b->rcache[j].hl);
+    }
+    free(b->rcache);
+    b->rcache = NULL;
+    b->nrcache = 0;
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    E.numrows--;
-    E.dirty++;
+void editorUseWindow(struct editorWindow *w) {
+    E.win = w;
+    E.buf = w->buf;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    // memmove() comes from <string.h>
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+void editorFocus(struct editorWindow *w) {
+    E.focus = w;
+    editorUseWindow(w);
 }
 
-void editorInsertNewLine() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
+// A window on b, added to the window list after window `after`.
+struct editorWindow *editorNewWindow(struct editorBuffer *b, struct editorWindow *after) {
+    struct editorWindow *w = calloc(1, sizeof(struct editorWindow));
+    if (w == NULL) die("malloc");
+    w->buf = b;
+    w->shadow_top = -1;
+    b->windows++;
+    if (after) {
+        w->next = after->next;
+        after->next = w;
     } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        w->next = E.windows;
+        E.windows = w;
     }
-    E.cy++;
-    E.cx = 0;
+    return w;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+void editorFreeWindow(struct editorWindow *w) {
+    struct editorWindow **p = &E.windows;
+    while (*p != w) p = &(*p)->next;
+    *p = w->next;
+    if (--w->buf->windows == 0) editorDropRenders(w->buf);
+    filterFree(w);
+    free(w);
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+editorSplit *editorNewSplit(struct editorWindow *w, editorSplit *parent) {
+    editorSplit *s = calloc(1, sizeof(editorSplit));
+    if (s == NULL) die("malloc");
+    s->win = w;
+    s->parent = parent;
+    w->node = s;
+    return s;
 }
 
-/*** editor operations ***/
-
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
-    }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+void editorFreeSplits(editorSplit *s) {
+    if (s == NULL) return;
+    editorFreeSplits(s->half[0]);
+    editorFreeSplits(s->half[1]);
+    free(s);
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
-
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+// Share rows x cols from top, left among the windows under s. A window
+// takes one line of its area for its status bar, and halves side by side
+// leave a column between them for the border.
+void editorLayout(editorSplit *s, int top, int left, int rows, int cols) {
+    s->top = top;
+    s->left = left;
+    s->rows = rows;
+    s->cols = cols;
+    if (s->win) {
+        struct editorWindow *w = s->win;
+        w->top = top;
+        w->left = left;
+        w->screenrows = rows - 1;
+        w->screencols = cols;
+        w->shadow_top = -1;
+        return;
+    }
+    if (s->vertical) {
+        int c = (cols - 1) / 2;
+        editorLayout(s->half[0], top, left, rows, c);
+        editorLayout(s->half[1], top, left + c + 1, rows, cols - c - 1);
     } else {
-        E.cx = E.row[E.cy - 1].size;
-        // editorRowAppendString(&E.row[E.cy - 1], E.row[E.cy].chars, E.row[E.cy].size);
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        int r = rows / 2;
+        editorLayout(s->half[0], top, left, r, cols);
+        editorLayout(s->half[1], top + r, left, rows - r, cols);
     }
 }
 
-/*** file i/o ***/
-
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++) {
-        totlen += E.row[j].size + 1;
+// Lay the windows out on the terminal. When it got too small for them,
+// only the focused window is kept.
+void editorLayoutAll() {
+    editorLayout(E.layout, 0, 0, E.termrows - 1, E.termcols);
+    struct editorWindow *w;
+    for (w = E.windows; w; w = w->next) {
+        if (w->screenrows < 1 || w->screencols < 1) break;
     }
-    *buflen = totlen;
+    if (w == NULL) return;
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+    while (E.windows != E.focus || E.focus->next) {
+        editorFreeWindow(E.windows == E.focus ? E.focus->next : E.windows);
     }
-
-    return buf;
+    editorFreeSplits(E.layout);
+    E.layout = editorNewSplit(E.focus, NULL);
+    editorLayout(E.layout, 0, 0, E.termrows - 1, E.termcols);
+    editorUseWindow(E.focus);
 }
 
-void editorOpen(char *filename) {
-    // strdup() comes from <string.h>
-    free(E.filename);
-    // E.filename = strdup(filename);-----------------------------------------------------------------------------------------------
-    E.filename = filename;
-    // FILE, fopen(), and getline() come from <stdio.h>.
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
-    
-    char *line = NULL;
-    size_t linecap = 0;
-    // malloc() comes from <stdlib.h>. ssize_t comes from <sys/types.h>
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        // remove the \n or \r from linelen
-        while (linelen > 0 &&  (line[linelen - 1] == '\n' || 
-                                line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+// Split the focused window in two showing the same place of its buffer,
+// one above the other or side by side. The new half gets the focus.
+void editorSplitWindow(int vertical) {
+    struct editorWindow *w = E.focus;
+    if (vertical ? w->screencols < 3 : w->screenrows + 1 < 4) {
+        editorSetStatusMessage("No room to split the window");
+        return;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    struct editorWindow *nw = editorNewWindow(w->buf, w);
+    nw->cx = w->cx;
+    nw->cy = w->cy;
+    // The new half shows every row; a grep view stays with the old one.
+    nw->rowoff = w->filter ? w->cy : w->rowoff;
+    nw->coloff = w->coloff;
+    nw->wrap = w->filter ? w->filter->wrap : w->wrap;
+    nw->rowsub = w->rowsub;
+
+    editorSplit *s = w->node;
+    s->win = NULL;
+    s->vertical = vertical;
+    s->half[0] = editorNewSplit(w, s);
+    s->half[1] = editorNewSplit(nw, s);
+    editorLayout(s, s->top, s->left, s->rows, s->cols);
+    editorFocus(nw);
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
+// Close the focused window; its sibling takes over the area the two
+// shared.
+void editorCloseWindow() {
+    struct editorWindow *w = E.focus;
+    editorSplit *s = w->node;
+    editorSplit *p = s->parent;
+    if (p == NULL) {
+        editorSetStatusMessage("Can't close the only window");
+        return;
     }
+    editorSplit *keep = p->half[p->half[0] == s];
+    p->win = keep->win;
+    p->vertical = keep->vertical;
+    p->half[0] = keep->half[0];
+    p->half[1] = keep->half[1];
+    if (p->win) p->win->node = p;
+    else p->half[0]->parent = p->half[1]->parent = p;
+    free(keep);
+    free(s);
+    editorLayout(p, p->top, p->left, p->rows, p->cols);
 
-    // open(), O_RDWR, and O_CREAT come from <fcntl.h>. ftruncate() and close() come from <unistd.h>.
-    int len;
-    char *buf = editorRowsToString(&len);
-
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
-    }
+    struct editorWindow *next = w->next ? w->next : E.windows;
+    editorFreeWindow(w);
+    editorFocus(next);
+}
 
-    free(buf);
-    editorSetStatusMessage("%d bytes written to disk", len);
+void editorNextWindow() {
+    editorFocus(E.focus->next ? E.focus->next : E.windows);
 }
 
-/*** find ***/
+// Show buffer b in the focused window, from its start.
+void editorShowBuffer(struct editorBuffer *b) {
+    struct editorWindow *w = E.focus;
+    struct editorBuffer *old = w->buf;
+    if (b == old) return;
+    filterFree(w);
+    b->windows++;
+    w->buf = b;
+    w->cx = w->cy = w->rx = 0;
+    w->rowoff = w->coloff = w->rowsub = 0;
+    w->shadow_top = -1;
+    if (--old->windows == 0) editorDropRenders(old);
+    editorUseWindow(w);
+}
 
-void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
+// Show the buffer after (d > 0) or before the current one.
+void editorCycleBuffer(int d) {
+    struct editorBuffer *b = E.buf;
+    if (d > 0) {
+        b = b->next ? b->next : E.buffers;
     } else {
-        last_match = -1;
-        direction = 1;
+        // From the first buffer this ends at the last one.
+        struct editorBuffer *p = E.buffers;
+        while (p->next && p->next != b) p = p->next;
+        b = p;
     }
+    editorShowBuffer(b);
+}
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    // strstr() comes from <string.h>.
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
-
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = i;
-            break;
-        }
+// Open a file in the focused window; a file already open shows its buffer.
+void editorOpenFile() {
+    char *name = editorPrompt("Open: %s (ESC to cancel)", NULL, 0);
+    if (name == NULL) {
+        editorSetStatusMessage("Open aborted");
+        return;
+    }
+    struct editorBuffer *b;
+    for (b = E.buffers; b; b = b->next) {
+        if (b->filename && strcmp(b->filename, name) == 0) break;
+    }
+    if (b) {
+        free(name);
+        editorShowBuffer(b);
+        return;
     }
+    if (access(name, R_OK) == -1) {
+        editorSetStatusMessage("Can't open %.40s: %s", name, strerror(errno));
+        free(name);
+        return;
+    }
+    editorShowBuffer(editorNewBuffer());
+    editorOpen(name);
 }
 
-void editorFind() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
-
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-
-    if (query) {
-        free(query);
-    } else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+// Draw the column between halves side by side, for every split under s.
+void editorDrawBorders(editorSplit *s) {
+    if (s->win) return;
+    if (s->vertical) {
+        int x = s->half[1]->left - 1;
+        int y;
+        screenRegion(s->top, x, 1);
+        for (y = 0; y < s->rows; y++) screenPut(y, 0, "|", 1, CELL_REVERSE);
     }
+    editorDrawBorders(s->half[0]);
+    editorDrawBorders(s->half[1]);
 }
 
-/*** append buffer ***/
+/*** output ***/ 
 
-struct abuf
-{
-    char *b;
-    int len;
-};
+// The cursor's screen line and column inside its row with soft wrap. The
+// row's line count is made right too, the cursor's line is only placed by
+// counts.
+void editorWrapCursor(int *line, int *col) {
+    *line = *col = 0;
+    erow *row = editorRowAt(E.win->cy);
+    if (row == NULL) return;
+    editorRowLines(E.win->cy);
+    editorWrapPos(editorRowRender(row), editorRowCxToRx(row, E.win->cx), line, col);
+}
 
-#define ABUF_INIT {NULL, 0}
+// The screen line at the top, counted from the start of the text.
+int editorTopLine() {
+    return E.win->wrap ? ropeLinesBefore(E.win->rowoff) + E.win->rowsub : E.win->rowoff;
+}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    // realloc() and free() come from <stdlib.h>. memcpy() comes from <string.h>.
-    char *new = realloc(ab->b, ab->len + len);
+// The cursor's line on screen, and how many lines of text follow it.
+int editorCursorLine() {
+    if (E.win->filter) return filterIndex(E.win->filter, E.win->cy) - E.win->rowoff;
+    if (!E.win->wrap) return E.win->cy - E.win->rowoff;
+    int line, col;
+    editorWrapCursor(&line, &col);
+    return ropeLinesBefore(E.win->cy) + line - editorTopLine();
+}
 
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+int editorLinesBelow() {
+    // Past the last row there is nothing below.
+    if (E.win->cy >= E.buf->numrows) return 0;
+    if (E.win->filter) return filterLines() - filterIndex(E.win->filter, E.win->cy) - 1;
+    if (!E.win->wrap) return E.buf->numrows - E.win->cy - 1;
+    int line, col;
+    editorWrapCursor(&line, &col);
+    return ropeLines(E.buf->rope) - ropeLinesBefore(E.win->cy) - line - 1;
 }
 
-void abFree(struct abuf *ab) {
-    free(ab->b);
+// Measure rows from `at` up to row `end` or a screenful, and tell whether
+// any of them had been counted wrong.
+int editorWrapMeasure(int at, int end) {
+    int changed = 0;
+    int stop = at + E.win->screenrows;
+    if (end > stop) end = stop;
+    if (end > E.buf->numrows) end = E.buf->numrows;
+    for (; at < end; at++) {
+        int old = editorRowAt(at)->wrap;
+        if (editorRowLines(at) != old) changed = 1;
+    }
+    return changed;
 }
 
-/*** output ***/ 
+// Scrolling with soft wrap goes by screen lines. Where they are is looked
+// up in the row buffer's line counts, so a jump does not add up the rows
+// in between; the rows between the top and the cursor are measured, and
+// when that corrects a count the top is placed again.
+void editorWrapScroll() {
+    E.win->coloff = 0;
+    editorWrapCursor(&E.win->wrap_line, &E.win->wrap_col);
+    do {
+        if (E.win->rowoff >= E.buf->numrows) E.win->rowsub = 0;
+        else if (E.win->rowsub >= editorRowLines(E.win->rowoff)) E.win->rowsub = editorRowLines(E.win->rowoff) - 1;
+        int top = editorTopLine();
+        int cur = ropeLinesBefore(E.win->cy) + E.win->wrap_line;
+        if (cur < top) {
+            E.win->rowoff = E.win->cy;
+            E.win->rowsub = E.win->wrap_line;
+        } else if (cur >= top + E.win->screenrows) {
+            E.win->rowoff = ropeRowAtLine(cur - E.win->screenrows + 1, &E.win->rowsub);
+        }
+    } while (editorWrapMeasure(E.win->rowoff, E.win->cy));
+}
+
+// Edits through another window on the buffer may have removed the text
+// under the cursor: keep it on a row, on the start of a character.
+void editorClampCursor() {
+    if (E.win->cy > E.buf->numrows) E.win->cy = E.buf->numrows;
+    erow *row = editorRowAt(E.win->cy);
+    if (row == NULL) {
+        E.win->cx = 0;
+        return;
+    }
+    if (E.win->cx > row->size) E.win->cx = row->size;
+    while (E.win->cx > 0 && E.win->cx < row->size && (row->chars[E.win->cx] & 0xc0) == 0x80) E.win->cx--;
+}
 
 void editorScroll() {
-    E.rx = 0;
-    if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    if (!E.buf->map.done) editorIndexPublish();
+
+    E.win->rx = 0;
+    if (E.win->cy < E.buf->numrows) {
+        E.win->rx = editorRowCxToRx(editorRowAt(E.win->cy), E.win->cx);
     }
 
-    if (E.cy < E.rowoff) {
-        E.rowoff = E.cy;
+    if (E.win->wrap) {
+        editorWrapScroll();
+        return;
     }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
+    // A grep view scrolls by its own lines.
+    int line = E.win->filter ? filterIndex(E.win->filter, E.win->cy) : E.win->cy;
+    if (line < E.win->rowoff) {
+        E.win->rowoff = line;
     }
-    if (E.rx < E.coloff) {
-        E.coloff = E.rx;
+    if (line >= E.win->rowoff + E.win->screenrows) {
+        E.win->rowoff = line - E.win->screenrows + 1;
     }
-    if (E.rx >= E.coloff + E.screencols) {
-        E.coloff = E.rx - E.screencols + 1;
+    if (E.win->rx < E.win->coloff) {
+        E.win->coloff = E.win->rx;
+    }
+    if (E.win->rx >= E.win->coloff + E.win->screencols) {
+        E.win->coloff = E.win->rx - E.win->screencols + 1;
     }
 }
 
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows() {
     int y;
-    for (y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows) {
+    editorHighlightSettle();
+    // With soft wrap a row goes on as many screen lines as it needs, the
+    // first row from its line rowsub on. A grep view skips rows, and the
+    // highlighter starts again after each gap.
+    int filerow = E.win->filter ? -1 : E.win->rowoff;
+    int state = E.win->filter ? HLS_NORMAL : editorRowState(E.win->rowoff - 1);
+    int lines = E.win->filter ? filterLines() : 0;
+    int sub = E.win->wrap ? E.win->rowsub : 0;
+    int lit = -1;
+    for (y = 0; y < E.win->screenrows; y++) {
+        screenClearLine(y);
+        if (E.win->filter) {
+            int k = E.win->rowoff + y;
+            int next = k < lines ? filterRow(k) : E.buf->numrows;
+            if (E.buf->syntax && next != filerow && next < E.buf->numrows) state = editorRowState(next - 1);
+            filerow = next;
+        }
+        if (filerow >= E.buf->numrows) {
             // snprintf() comes from <stdio.h>.
-            if (E.numrows == 0 && y == E.screenrows / 3) {
+            if (E.buf->numrows == 0 && y == E.win->screenrows / 3) {
                 char welcome[80];
                 int welcomelen = snprintf(welcome, sizeof(welcome),
                 "Kilo editor -- version %s", KILO_VERSION);
-                if (welcomelen > E.screencols) welcomelen = E.screencols;
-                int padding = (E.screencols - welcomelen) / 2;
+                if (welcomelen > E.win->screencols) welcomelen = E.win->screencols;
+                int padding = (E.win->screencols - welcomelen) / 2;
                 if (padding) {
-                abAppend(ab, "~", 1);
-                padding--;
-                }
-                while (padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
-                if (DEBUG){
-                    int padding2 = (E.screencols - welcomelen) / 2;
-                    while (padding2--) abAppend(ab, "-", 1);
-                    printf("__%d;%d-%d  ", E.screenrows / 3, E.screencols, welcomelen);
+                screenPut(y, 0, "~", 1, 0);
                 }
+                screenPut(y, padding, welcome, welcomelen, 0);
             } else {
-                if (DEBUG){int pad = E.screencols; while (pad--) {abAppend(ab, "~", 1);printf("%d", E.screencols);}}
-                else {abAppend(ab, "~", 1);}
+                screenPut(y, 0, "~", 1, 0);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff < 0 ? 0 : E.row[filerow].rsize - E.coloff;
-            if (len > E.screencols) len = E.screencols;
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
-        }
-
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
-    }
-}
-
-void editorDrawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%d%s",
-        E.filename ? E.filename : "[No Name]", E.numrows,
-        E.dirty ? "(" : "",
-        E.dirty ? E.dirty : 0,
-        E.dirty ? " changes have been modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-        E.cy + 1, E.numrows);
-    len = len > E.screencols ? E.screencols : len;
-    abAppend(ab, status, len);
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            // len++;
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
+            erow *row = editorRowAt(filerow);
+            renderSlot *rs = editorRowRender(row);
+            if (E.buf->syntax && filerow != lit) {
+                state = editorRowHighlight(row, rs, state);
+                lit = filerow;
+            }
+            int at, end, x = 0;
+            if (E.win->wrap) {
+                int rx;
+                at = editorWrapLineStart(rs, sub, &rx);
+                end = editorWrapLineStart(rs, sub + 1, &rx);
+                if (++sub >= editorRowLines(filerow)) {
+                    filerow++;
+                    sub = 0;
+                }
+            } else {
+                // A wide character cut by the left edge shows as a space.
+                int col;
+                at = editorRenderOffset(rs, E.win->coloff, &col);
+                end = rs->len;
+                x = screenFill(y, 0, ' ', col - E.win->coloff, 0);
+                filerow++;
+            }
+            if (E.buf->syntax)
+                screenPutHl(y, x, &rs->render[at], &rs->hl[at], end - at);
+            else
+                screenPut(y, x, &rs->render[at], end - at, 0);
         }
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf * ab) {
-    abAppend(ab, "\x1b[K", 3);
+// n with thousands separators, as in 12,345.
+void editorFormatCount(char *buf, int n) {
+    char digits[16];
+    int len = snprintf(digits, sizeof(digits), "%d", n);
+    int j, k = 0;
+    for (j = 0; j < len; j++) {
+        if (j > 0 && (len - j) % 3 == 0) buf[k++] = ',';
+        buf[k++] = digits[j];
+    }
+    buf[k] = '\0';
+}
+
+void editorDrawStatusBar() {
+    int y = E.win->screenrows;
+    screenClearLine(y);
+    char status[160], rstatus[80];
+    perfCounters *f = &E.perf_frame;
+    int len;
+    if (E.perf_overlay && E.win == E.focus)
+        len = snprintf(status, sizeof(status), "build %lldus | flush %lldB in %lld writes | "
+            "%lld renders | %lld allocs | paint %lldus",
+            f->build_us, f->flush_bytes, f->flush_writes, f->renders, f->allocs, E.perf_paint_us);
+    else
+        len = snprintf(status, sizeof(status), "%.20s - %s%d lines %s%d%s",
+        E.buf->filename ? E.buf->filename : "[No Name]",
+        E.buf->map.done ? "" : "indexing... ", E.buf->numrows,
+        E.buf->dirty ? "(" : "",
+        E.buf->dirty ? E.buf->dirty : 0,
+        E.buf->dirty ? " changes have been modified)" : "");
+    int rlen;
+    if (E.search.active && E.search.qlen > 0 && E.win == E.focus) {
+        char cur[16], total[16];
+        pthread_mutex_lock(&E.search.lock);
+        int n = E.search.nmatches;
+        int done = E.search.done;
+        pthread_mutex_unlock(&E.search.lock);
+        editorFormatCount(cur, E.search.current + 1);
+        editorFormatCount(total, n);
+        const char *mode = E.search.regex ? "regex " : "";
+        if (E.search.error)
+            rlen = snprintf(rstatus, sizeof(rstatus), "regex: %s", E.search.error);
+        else if (n == 0 && done)
+            rlen = snprintf(rstatus, sizeof(rstatus), "%sno matches", mode);
+        else
+            rlen = snprintf(rstatus, sizeof(rstatus), "%smatch %s of %s%s",
+                mode, cur, total, done ? "" : "+");
+    } else if (E.win->filter) {
+        rlen = snprintf(rstatus, sizeof(rstatus), "grep %.20s: %d | %s | %d/%d",
+            E.win->filter->query, E.win->filter->n,
+            E.buf->syntax ? E.buf->syntax->filetype : "no ft", E.win->cy + 1, E.buf->numrows);
+    } else {
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+            E.buf->syntax ? E.buf->syntax->filetype : "no ft", E.win->cy + 1, E.buf->numrows);
+    }
+    len = len > E.win->screencols ? E.win->screencols : len;
+    screenPut(y, 0, status, len, CELL_REVERSE);
+    screenFill(y, len, ' ', E.win->screencols - len, CELL_REVERSE);
+    if (E.win->screencols - len >= rlen)
+        screenPut(y, E.win->screencols - rlen, rstatus, rlen, CELL_REVERSE);
+}
+
+void editorDrawMessageBar() {
+    int y = 0;
+    screenClearLine(y);
     int msglen = strlen(E.statusmsg);
-    msglen = msglen < E.screencols ? msglen : E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < 5) 
-        abAppend(ab, E.statusmsg, msglen);
+    msglen = msglen < E.clip_cols ? msglen : E.clip_cols;
+    E.statusmsg_shown = msglen && time(NULL) - E.statusmsg_time < KILO_STATUS_SECS;
+    if (E.statusmsg_shown)
+        screenPut(y, 0, E.statusmsg, msglen, 0);
 }
 
 void editorRefreshScreen() {
-    editorScroll();
+    long long start = perfMicros();
+    E.frame++;
+    E.last_frame = editorNow();
+    E.redraw_at = 0;
+    struct editorBuffer *b;
+    for (b = E.buffers; b; b = b->next) {
+        E.buf = b;
+        editorFollow();
+    }
 
-    struct abuf ab = ABUF_INIT;
+    // The frame buffer is kept from one frame to the next.
+    static struct abuf ab = ABUF_INIT;
 
     // // write() and STDOUT_FILENO come from <unistd.h>.
     // // https://vt100.net/docs/vt100-ug/chapter3.html#ED
@@ -633,25 +6653,42 @@ void editorRefreshScreen() {
     // write(STDOUT_FILENO, "\x1b[2J", 4);
     // write(STDOUT_FILENO, "\x1b[H", 3);
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    // abAppend(&ab, "\x1b[2J", 4);
-    abAppend(&ab, "\x1b[H", 3);
-
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    // All windows go into one frame, sent in one write.
+    screenEnsure();
+    struct editorWindow *w;
+    for (w = E.windows; w; w = w->next) {
+        editorUseWindow(w);
+        editorClampCursor();
+        editorScroll();
+        screenRegion(w->top, w->left, w->screencols);
+        editorDrawRows();
+        editorDrawStatusBar();
+    }
+    editorDrawBorders(E.layout);
+    screenRegion(E.termrows - 1, 0, E.termcols);
+    editorDrawMessageBar();
 
-    // strlen() comes from <string.h>.
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    editorUseWindow(E.focus);
+    if (E.win->wrap)
+        screenFlush(&ab, E.win->top + editorCursorLine(), E.win->left + E.win->wrap_col);
+    else
+        screenFlush(&ab, E.win->top + editorCursorLine(), E.win->left + E.win->rx - E.win->coloff);
+    perf.build_us += perfMicros() - start;
 
-    // write(STDOUT_FILENO, "\x1b[H", 3);
-    // abAppend(&ab, "\x1b[H", 3);
-    abAppend(&ab, "\x1b[?25h", 6);
-    
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    if (abFlush(&ab, STDOUT_FILENO) == -1) die("write");
+    perf.frames++;
+    if (E.input_at) {
+        E.perf_paint_us = perfMicros() - E.input_at;
+        E.input_at = 0;
+        perf.painted++;
+        perf.paint_us += E.perf_paint_us;
+        if (E.perf_paint_us > perf.paint_max_us) perf.paint_max_us = E.perf_paint_us;
+    }
+    perfSince(&E.perf_frame, &E.perf_mark);
+    E.perf_mark = perf;
+#ifdef KILO_BENCH
+    benchFrame();
+#endif
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -665,7 +6702,9 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 /*** input ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+// Read a line in the message bar. Returns it, or NULL when ESC cancels;
+// Enter on nothing typed only counts when empty is set.
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int empty) {
     size_t bufsize = 128;
 	char *buf = malloc(bufsize);
 
@@ -685,11 +6724,24 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         free(buf);
         return NULL;
         } else if (c == '\r') {
-			if (buflen != 0) {
+			if (buflen != 0 || empty) {
 				editorSetStatusMessage("");
                 if (callback) callback(buf, c);
 				return buf;
 			}
+        } else if (c == PASTE_KEY) {
+            // Only the printable part of a paste makes sense in a prompt.
+            size_t j;
+            for (j = 0; j < E.pastelen; j++) {
+                char p = E.paste[j];
+                if (iscntrl((unsigned char)p)) continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = p;
+            }
+            buf[buflen] = '\0';
 		} else if (!iscntrl(c) && c < 128) {
 			if (buflen == bufsize - 1) {
 				bufsize *= 2;
@@ -703,41 +6755,86 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     }
 }
 
+// Up or down by one screen line with soft wrap, keeping the screen column.
+void editorWrapMoveCursor(int d) {
+    int line, col;
+    editorWrapCursor(&line, &col);
+    if (d < 0) {
+        if (line > 0) {
+            line--;
+        } else if (E.win->cy > 0) {
+            E.win->cy--;
+            line = editorRowLines(E.win->cy) - 1;
+        } else {
+            return;
+        }
+    } else {
+        if (E.win->cy < E.buf->numrows && line < editorRowLines(E.win->cy) - 1) {
+            line++;
+        } else if (E.win->cy < E.buf->numrows) {
+            E.win->cy++;
+            line = 0;
+        } else {
+            return;
+        }
+    }
+    erow *row = editorRowAt(E.win->cy);
+    E.win->cx = row ? editorRowRxToCx(row, editorWrapRx(editorRowRender(row), line, col)) : 0;
+}
+
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    if (E.win->wrap && (key == ARROW_UP || key == ARROW_DOWN)) {
+        editorWrapMoveCursor(key == ARROW_UP ? -1 : 1);
+        return;
+    }
+
+    erow *row = editorRowAt(E.win->cy);
+    // Up and down keep the cursor in the same screen column.
+    int rx = -1;
+    // The rows before and after the cursor's; in a grep view the ones
+    // next to it in the view.
+    int prev = E.win->cy > 0 ? E.win->cy - 1 : -1;
+    int next = E.win->cy < E.buf->numrows ? E.win->cy + 1 : -1;
+    if (E.win->filter) {
+        prev = filterStep(-1);
+        next = filterStep(1);
+    }
 
     switch (key) {
         case ARROW_LEFT:
-            if (E.cx != 0) {
-                E.cx--;
-            } else if (E.cy > 0) {
-                E.cy--;
-                E.cx = E.row[E.cy].size;
+            if (E.win->cx != 0) {
+                E.win->cx = editorRowPrevCx(row, E.win->cx);
+            } else if (prev != -1) {
+                E.win->cy = prev;
+                E.win->cx = editorRowAt(E.win->cy)->size;
             }
             break;
         case ARROW_RIGHT:
-            if (row && E.cx < row->size) {
-                E.cx++;
-            } else if (row && E.cx == row->size) {
-                E.cy++;
-                E.cx = 0;
+            if (row && E.win->cx < row->size) {
+                E.win->cx = editorRowNextCx(row, E.win->cx);
+            } else if (row && E.win->cx == row->size && next != -1) {
+                E.win->cy = next;
+                E.win->cx = 0;
             }
             break;
         case ARROW_UP:
-            if (E.cy > 0) {
-                E.cy--;
+            if (prev != -1) {
+                if (row) rx = editorRowCxToRx(row, E.win->cx);
+                E.win->cy = prev;
             }
             break;
         case ARROW_DOWN:
-            if (E.cy < E.numrows) {
-                E.cy++;
+            if (next != -1) {
+                if (row) rx = editorRowCxToRx(row, E.win->cx);
+                E.win->cy = next;
             }
             break;
     }
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = editorRowAt(E.win->cy);
+    if (row && rx != -1) E.win->cx = editorRowRxToCx(row, rx);
     int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen) {
-        E.cx = rowlen;
+    if (E.win->cx > rowlen) {
+        E.win->cx = rowlen;
     }
 }
 
@@ -752,28 +6849,47 @@ void editorProcessKeypress() {
         break;
 
     case CTRL_KEY('q'):
-        if (E.dirty && quit_times > 0) {
-            editorSetStatusMessage("WARNING!!! File has unsaved changes. "
-                "Press Ctrl-Q %d more times to quit.", quit_times);
+    {
+        struct editorBuffer *b = E.buffers;
+        while (b && !b->dirty) b = b->next;
+        if (b && quit_times > 0) {
+            editorSetStatusMessage("WARNING!!! %.20s has unsaved changes. "
+                "Press Ctrl-Q %d more times to quit.",
+                b->filename ? b->filename : "[No Name]", quit_times);
             quit_times--;
             return;
         }
+        for (E.buf = E.buffers; E.buf; E.buf = E.buf->next) journalStop(1);
         write(STDOUT_FILENO, "\x1b[2J", 4);
         write(STDOUT_FILENO, "\x1b[H", 3);
         exit(0);
         break;
+    }
 
     case CTRL_KEY('s'):
         editorSave();
         break;
 
+    case CTRL_KEY('z'):
+        editorUndo();
+        break;
+
+    case CTRL_KEY('y'):
+        editorRedo();
+        break;
+
+    case PASTE_KEY:
+        editorInsertText(E.paste, E.pastelen);
+        break;
+
     case PAGE_UP: 
     {
         int times;
-        if ((E.cy - E.rowoff) == 0) {
-            times = E.screenrows;
+        int y = editorCursorLine();
+        if (y == 0) {
+            times = E.win->screenrows;
         } else {
-            times = E.cy - E.rowoff;
+            times = y;
         }
         while (times--)
           editorMoveCursor(ARROW_UP);
@@ -782,29 +6898,75 @@ void editorProcessKeypress() {
     case PAGE_DOWN: 
     {
         int times;
+        int y = editorCursorLine();
         
-        if ((E.cy - E.rowoff) != E.screenrows - 1) {
-            times = E.screenrows - (E.cy - E.rowoff) - 1;
+        if (y != E.win->screenrows - 1) {
+            times = E.win->screenrows - y - 1;
         } else {
-            times = E.screenrows > E.numrows - E.cy - 1 ? E.numrows - E.cy - 1 : E.screenrows;
+            int below = editorLinesBelow();
+            times = E.win->screenrows > below ? below : E.win->screenrows;
         }
         while (times--)
           editorMoveCursor(ARROW_DOWN);
         break;
     }
     case HOME_KEY:
-        E.cx = 0;
+        E.win->cx = 0;
         break;
       
     case END_KEY:
-        if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
+        if (E.win->cy < E.buf->numrows)
+            E.win->cx = editorRowAt(E.win->cy)->size;
         break;
 
     case CTRL_KEY('f'):
       editorFind();
       break;
 
+    case CTRL_KEY('r'):
+        editorReplace();
+        break;
+
+    case CTRL_KEY('g'):
+        editorFilter();
+        break;
+
+    case CTRL_KEY('o'):
+        editorOpenFile();
+        break;
+
+    // Windows and buffers go by a second key after Ctrl-X.
+    case CTRL_KEY('x'):
+        editorSetStatusMessage("Ctrl-X: s/v = split | o = other window | c = close | n/p = next/previous buffer");
+        editorRefreshScreen();
+        c = editorReadKey();
+        editorSetStatusMessage("");
+        switch (c) {
+            case 's': editorSplitWindow(0); break;
+            case 'v': editorSplitWindow(1); break;
+            case 'o': editorNextWindow(); break;
+            case 'c': editorCloseWindow(); break;
+            case 'n': editorCycleBuffer(1); break;
+            case 'p': editorCycleBuffer(-1); break;
+        }
+        break;
+
+    case CTRL_KEY('p'):
+        E.perf_overlay = !E.perf_overlay;
+        break;
+
+    case CTRL_KEY('w'):
+        if (E.win->filter) {
+            editorSetStatusMessage("No soft wrap in a grep view");
+            break;
+        }
+        E.win->wrap = !E.win->wrap;
+        E.win->rowsub = 0;
+        E.win->coloff = 0;
+        E.shadow_valid = 0;
+        editorSetStatusMessage("Soft wrap %s", E.win->wrap ? "on" : "off");
+        break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -834,40 +6996,383 @@ void editorProcessKeypress() {
 /*** init ***/
 
 void initEditor() {
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoff = 0;
-    E.coloff = 0;
-    E.numrows = 0;
-    E.row = NULL;
-    E.filename = NULL;
+    E.rope_seed = 2463534242u;
+    E.frame = 0;
+    E.screen = NULL;
+    E.shadow = NULL;
+    E.shadow_valid = 0;
+    memset(&E.search, 0, sizeof(E.search));
+    pthread_mutex_init(&E.search.lock, NULL);
+    pthread_cond_init(&E.search.cond, NULL);
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
-    E.dirty = 0;
+    E.statusmsg_shown = 0;
+    // getenv() comes from <stdlib.h>.
+    const char *colorterm = getenv("COLORTERM");
+    const char *term = getenv("TERM");
+    if (colorterm && (strstr(colorterm, "truecolor") || strstr(colorterm, "24bit")))
+        E.colors = 1 << 24;
+    else if (term && strstr(term, "256color"))
+        E.colors = 256;
+    else
+        E.colors = 16;
+    E.inlen = 0;
+    E.inpos = 0;
+    E.winch = 0;
+    E.notify_fd = -1;
+    E.redraw_at = 0;
+    E.last_frame = 0;
+    E.paste = NULL;
+    E.pastelen = 0;
+    E.pastecap = 0;
 
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-    // printf("%d", E.screencols);
-    E.screenrows -= 2;
-    if (DEBUG){
-        printf("%d;%d", E.screenrows, E.screencols);
-    }
+    // pipe2() comes from <unistd.h>, sigaction() from <signal.h>.
+    if (pipe2(E.wake, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe");
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleWinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+
+    if (getenv("KILO_PERF")) atexit(perfDump);
+
+    // One window on an empty buffer to start with.
+    E.buffers = NULL;
+    E.windows = NULL;
+    editorFocus(editorNewWindow(editorNewBuffer(), NULL));
+    E.layout = editorNewSplit(E.win, NULL);
+    editorLayout(E.layout, 0, 0, E.termrows - 1, E.termcols);
 }
 
 int main(int argc, char *argv[]){
+#ifdef KILO_BENCH
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) return benchMain(argc - 2, &argv[2]);
+#endif
     enableRawMode();
+    if (getWindowSize(&E.termrows, &E.termcols) == -1) die("getWindowSize");
     initEditor();
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = replace | Ctrl-G = grep | Ctrl-Z/Y = undo/redo | Ctrl-O = open | Ctrl-X = windows");
+    int arg = 1;
+    int follow = 0;
+    if (argc >= 2 && strcmp(argv[1], "-f") == 0) {
+        follow = 1;
+        arg++;
+    }
+    // Every file named gets a buffer; the window shows the first.
+    for (; arg < argc; arg++) {
+        if (E.buf->filename) editorShowBuffer(editorNewBuffer());
+        E.buf->map.follow = follow;
+        editorOpen(argv[arg]);
+    }
+    editorShowBuffer(E.buffers);
+    if (E.buf->map.follow) {
+        // Start at the end, as tail -f does.
+        editorIndexAll();
+        if (E.buf->numrows > 0) E.win->cy = E.buf->numrows - 1;
     }
-
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
 
 
     while (1) {
-        editorRefreshScreen();
+        // Keys that arrived together (a paste, a held key) are handled in
+        // one go and drawn once.
+        if (!editorInputPending()) editorRefreshScreen();
         editorProcessKeypress();
     }
 
     return 0;
 }
+
+/*** bench ***/
+
+#ifdef KILO_BENCH
+
+// `main --bench [size...]` writes a file of each size (1K, 64M, 10G ...)
+// and runs the editor on it in a child process, with scripted keys. The
+// terminal is replaced by a pipe for input and a plain file for output,
+// so frames never wait for a reader and the size of a frame is how far
+// the file offset moved. A feeder thread sends one key at a time and
+// waits for the frame that shows it. Results are printed as one JSON
+// object per line.
+
+struct benchState {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // the editor's input, and where the results go.
+    int keys;
+    int out;
+    long long size;
+    // set while a key is on its way: the first frame drawn once the
+    // editor has read it ends the wait, and tells when it was done and
+    // how many bytes it took.
+    int waiting;
+    long long frame_at;
+    long long frame_bytes;
+    off_t sink_end;
+    // the editor's counts as of its last frame, and as of the start of
+    // the current scenario; allocations are counted by perf, see "perf".
+    perfCounters counts;
+    perfCounters from;
+    // what the current scenario measured.
+    long long *lat;
+    int nlat;
+    int latcap;
+    int lost;
+    long long bytes;
+};
+
+struct benchState bench;
+
+// Called by the editor after each frame.
+void benchFrame() {
+    off_t end = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    int unread = 0;
+    ioctl(STDIN_FILENO, FIONREAD, &unread);
+    pthread_mutex_lock(&bench.lock);
+    if (bench.waiting && unread == 0 && !editorInputPending()) {
+        bench.waiting = 0;
+        bench.frame_at = perfMicros();
+        bench.frame_bytes = end - bench.sink_end;
+        pthread_cond_signal(&bench.cond);
+    }
+    bench.sink_end = end;
+    perfSince(&bench.counts, NULL);
+    // The sink only counts; keep it from filling the disk.
+    if (end > ((off_t)1 << 26) && ftruncate(STDOUT_FILENO, 0) == 0) {
+        lseek(STDOUT_FILENO, 0, SEEK_SET);
+        bench.sink_end = 0;
+    }
+    pthread_mutex_unlock(&bench.lock);
+}
+
+// Wait for the frame a key sent at `sent` asked for, and note how long
+// it took. The lock is held.
+void benchWait(long long sent) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += KILO_BENCH_TIMEOUT;
+    while (bench.waiting) {
+        if (pthread_cond_timedwait(&bench.cond, &bench.lock, &until) == ETIMEDOUT) break;
+    }
+    if (bench.waiting) {
+        bench.waiting = 0;
+        bench.lost++;
+        return;
+    }
+    if (bench.nlat == bench.latcap) {
+        bench.latcap = bench.latcap ? bench.latcap * 2 : 1024;
+        bench.lat = realloc(bench.lat, sizeof(long long) * bench.latcap);
+        if (bench.lat == NULL) die("realloc");
+    }
+    bench.lat[bench.nlat++] = bench.frame_at - sent;
+    bench.bytes += bench.frame_bytes;
+}
+
+// Send one key, as the terminal would in one read, and wait until it is
+// drawn.
+void benchKey(const char *s, int len) {
+    pthread_mutex_lock(&bench.lock);
+    bench.waiting = 1;
+    long long sent = perfMicros();
+    if (write(bench.keys, s, len) != len) die("write");
+    benchWait(sent);
+    pthread_mutex_unlock(&bench.lock);
+}
+
+void benchBegin() {
+    bench.nlat = 0;
+    bench.lost = 0;
+    bench.bytes = 0;
+    pthread_mutex_lock(&bench.lock);
+    bench.from = bench.counts;
+    pthread_mutex_unlock(&bench.lock);
+}
+
+int benchCmp(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+void benchReport(const char *scenario) {
+    long long p50 = 0, p99 = 0, max = 0, per_frame = 0;
+    int n = bench.nlat;
+    if (n > 0) {
+        qsort(bench.lat, n, sizeof(long long), benchCmp);
+        p50 = bench.lat[(n - 1) * 50 / 100];
+        p99 = bench.lat[(n - 1) * 99 / 100];
+        max = bench.lat[n - 1];
+        per_frame = bench.bytes / n;
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    dprintf(bench.out, "{\"size\":%lld,\"scenario\":\"%s\",\"keys\":%d,\"lost\":%d,"
+        "\"p50_us\":%lld,\"p99_us\":%lld,\"max_us\":%lld,\"bytes_per_frame\":%lld,"
+        "\"allocs\":%lld,\"alloc_bytes\":%lld,\"peak_rss_kb\":%ld}\n",
+        bench.size, scenario, n, bench.lost, p50, p99, max, per_frame,
+        bench.counts.allocs - bench.from.allocs, bench.counts.alloc_bytes - bench.from.alloc_bytes,
+        ru.ru_maxrss);
+}
+
+void benchRepeat(const char *key, int times) {
+    while (times-- > 0) benchKey(key, strlen(key));
+}
+
+void *benchFeeder(void *arg) {
+    int j;
+
+    // From the start to the first frame; the wait began before the open.
+    long long start = *(long long *)arg;
+    pthread_mutex_lock(&bench.lock);
+    benchWait(start);
+    pthread_mutex_unlock(&bench.lock);
+    benchReport("open");
+
+    benchBegin();
+    const char *text = "the quick brown fox jumps over the lazy dog ";
+    for (j = 0; j < 2000; j++) {
+        char c = j % 60 == 59 ? '\r' : text[j % 44];
+        benchKey(&c, 1);
+    }
+    benchReport("typing");
+
+    benchBegin();
+    char paste[4096];
+    int len = snprintf(paste, sizeof(paste), "\x1b[200~");
+    for (j = 0; j < 40; j++)
+        len += snprintf(&paste[len], sizeof(paste) - len, "    pasted_%d(a, b, \"%s\");\n", j, text);
+    len += snprintf(&paste[len], sizeof(paste) - len, "\x1b[201~");
+    for (j = 0; j < 50; j++) benchKey(paste, len);
+    benchReport("paste");
+
+    benchBegin();
+    benchRepeat("\x1b[6~", 200);
+    benchRepeat("\x1b[B", 200);
+    benchRepeat("\x1b[6~", 200);
+    benchRepeat("\x1b[5~", 400);
+    benchReport("paging");
+
+    benchBegin();
+    benchRepeat("\x06", 1);
+    for (j = 0; "needle"[j]; j++) benchKey(&"needle"[j], 1);
+    benchRepeat("\x1b[B", 100);
+    benchRepeat("\r", 1);
+    benchReport("find");
+
+    benchBegin();
+    for (j = 0; j < 5; j++) {
+        benchRepeat("x", 1);
+        benchRepeat("\x13", 1);
+    }
+    benchReport("save");
+
+    // The last of these quits without a frame.
+    if (write(bench.keys, "\x11\x11\x11\x11", 4) != 4) die("write");
+    while (1) pause();
+    return NULL;
+}
+
+// The child: run the editor on path, with the feeder sending keys.
+void benchRun(const char *path) {
+    int keys[2];
+    FILE *sink = tmpfile();
+    if (pipe(keys) == -1 || sink == NULL) die("bench");
+    bench.out = dup(STDOUT_FILENO);
+    bench.keys = keys[1];
+    dup2(keys[0], STDIN_FILENO);
+    dup2(fileno(sink), STDOUT_FILENO);
+    close(keys[0]);
+    fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&bench.lock, NULL);
+    pthread_cond_init(&bench.cond, NULL);
+
+    static long long start;
+    start = perfMicros();
+    bench.waiting = 1;
+    E.termrows = KILO_BENCH_ROWS;
+    E.termcols = KILO_BENCH_COLS;
+    initEditor();
+    editorOpen(strdup(path));
+
+    pthread_t feeder;
+    if (pthread_create(&feeder, NULL, benchFeeder, &start) != 0) die("pthread_create");
+    while (1) {
+        if (!editorInputPending()) editorRefreshScreen();
+        editorProcessKeypress();
+    }
+}
+
+// Write a file of `size` bytes of C-like lines, some of them with the
+// word the find scenario looks for. Returns its name.
+char *benchGenerate(long long size) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL) dir = "/tmp";
+    char *path = malloc(strlen(dir) + 32);
+    if (path == NULL) die("malloc");
+    sprintf(path, "%s/kilo-bench-XXXXXX.c", dir);
+    int fd = mkstemps(path, 2);
+    if (fd == -1) die("mkstemps");
+
+    // One block of lines, written over and over.
+    static char block[1 << 20];
+    int len = 0, n = 0;
+    while (len < (int)sizeof(block) - 128) {
+        switch (n % 6) {
+            case 0: len += sprintf(&block[len], "int func_%d(int a, char *b) {\n", n); break;
+            case 1: len += sprintf(&block[len], "    if (a > %d) return b[a] + 0x%x;\n", n, n); break;
+            case 2: len += sprintf(&block[len], "    // a comment about line %d\n", n); break;
+            case 3: len += sprintf(&block[len], n % 20 == 3 ? "    needle_%d(a, b);\n" : "    printf(\"%%d\\n\", %d);\n", n); break;
+            case 4: len += sprintf(&block[len], "    return \"a string %d\";\n", n); break;
+            default: len += sprintf(&block[len], "}\n"); break;
+        }
+        n++;
+    }
+    long long left = size;
+    while (left > 0) {
+        int chunk = left < len ? (int)left : len;
+        if (write(fd, block, chunk) != chunk) die("write");
+        left -= chunk;
+    }
+    close(fd);
+    return path;
+}
+
+int benchMain(int argc, char *argv[]) {
+    static char *sizes[] = { "1K", "1M", "64M" };
+    if (argc == 0) {
+        argc = sizeof(sizes) / sizeof(sizes[0]);
+        argv = sizes;
+    }
+    int j, failed = 0;
+    for (j = 0; j < argc; j++) {
+        char *end;
+        long long size = strtoll(argv[j], &end, 10);
+        switch (*end) {
+            case 'G': case 'g': size <<= 10; // fall through
+            case 'M': case 'm': size <<= 10; // fall through
+            case 'K': case 'k': size <<= 10;
+        }
+        if (size <= 0) {
+            fprintf(stderr, "bench: bad size %s\n", argv[j]);
+            return 1;
+        }
+        char *path = benchGenerate(size);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) die("fork");
+        if (pid == 0) {
+            bench.size = size;
+            benchRun(path);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("{\"size\":%lld,\"error\":\"editor exited with status %d\"}\n", size, status);
+            failed = 1;
+        }
+        unlink(path);
+        free(path);
+    }
+    return failed;
+}
+
+#endif